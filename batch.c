@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "clock.h"
+#include "batch.h"
+#include "trace.h"
+
+#define BATCH_PROMPT "chat>"
+
+static void batch_due(wheel_timer_t *t, void *arg);
+
+void batch_init(batch_buf_t *b, outq_t *out) {
+    pthread_mutex_init(&b->lock, NULL);
+    b->out = out;
+    b->data = NULL;
+    b->len = 0;
+    b->deadline_ns = 0;
+    wheel_timer_init(&b->timer, batch_due, b);
+}
+
+void batch_destroy(batch_buf_t *b) {
+    wheel_cancel(&b->timer);
+    free(b->data);
+    b->data = NULL;
+    pthread_mutex_destroy(&b->lock);
+}
+
+/* Send everything pending as a single payload; caller holds b->lock */
+static void batch_flush_locked(batch_buf_t *b) {
+    if (b->len == 0) return;
+
+    memcpy(b->data + b->len, BATCH_PROMPT, strlen(BATCH_PROMPT));
+    outq_send(b->out, OUT_CHAT, b->data, b->len + strlen(BATCH_PROMPT));
+    b->len = 0;
+    b->deadline_ns = 0;
+}
+
+void batch_enqueue(batch_buf_t *b, const char *line, size_t len, int window_ms) {
+    size_t room_left = BATCH_MAXBUFF - strlen(BATCH_PROMPT);
+    if (len > room_left) len = room_left;
+
+    pthread_mutex_lock(&b->lock);
+
+    /* Most users never see a batched room, so the buffer is lazy */
+    if (!b->data && !(b->data = malloc(BATCH_MAXBUFF))) {
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+
+    if (b->len + len > room_left) {
+        batch_flush_locked(b);
+    }
+
+    memcpy(b->data + b->len, line, len);
+    b->len += len;
+
+    /* The first line starts the window; a shorter window may pull it in */
+    uint64_t deadline = now_ns() + (uint64_t)window_ms * 1000000ull;
+    if (b->deadline_ns == 0 || deadline < b->deadline_ns) {
+        b->deadline_ns = deadline;
+        wheel_arm(&b->timer, window_ms);
+    }
+
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Wheel callback: flush once the window has closed */
+static void batch_due(wheel_timer_t *t, void *arg) {
+    batch_buf_t *b = arg;
+    uint64_t t0 = TRACE_START();
+
+    pthread_mutex_lock(&b->lock);
+    if (b->deadline_ns != 0) {
+        uint64_t now = now_ns();
+        if (b->deadline_ns <= now) {
+            batch_flush_locked(b);
+        } else {
+            /* fired on the tick before the deadline */
+            wheel_arm(t, (b->deadline_ns - now + 999999) / 1000000);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    TRACE_SPAN(TR_BATCH_FLUSH, t0, 0);
+}
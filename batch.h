@@ -0,0 +1,37 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "outq.h"
+#include "wheel.h"
+
+#define BATCH_MAXBUFF  8192      // pending bytes per recipient before an early flush
+#define MAX_BATCH_MS   1000      // upper bound for a room's batching window
+
+/*
+ * Per-recipient buffer of chat lines that arrived through batched rooms.
+ * Lines are appended by sender threads (under the list read lock) and
+ * sent as one combined payload when the window's deadline passes; the
+ * deadline is a timer on the shared wheel.
+ */
+typedef struct batch_buf {
+    pthread_mutex_t lock;
+    outq_t  *out;                // where flushes go
+    char    *data;               // BATCH_MAXBUFF, allocated on first use
+    size_t   len;
+    uint64_t deadline_ns;        // 0 when empty
+    wheel_timer_t timer;
+} batch_buf_t;
+
+void batch_init(batch_buf_t *b, outq_t *out);
+void batch_destroy(batch_buf_t *b);
+
+/*
+ * Queue one chat line (without the trailing prompt) for delivery within
+ * window_ms. Flushes early if the buffer would overflow.
+ */
+void batch_enqueue(batch_buf_t *b, const char *line, size_t len, int window_ms);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * bench_list - microbenchmarks for the list.c data structures.
+ *
+ * Usage: bench_list [-n max_entities] [-t threads] [-d ms] [-b name]
+ *
+ * Every benchmark is run at 1k, 10k, 100k and 1M entities (up to -n),
+ * first single-threaded and then with -t contending threads, and reports
+ * ops/sec plus hardware cache misses per op (via perf_event_open, when the
+ * kernel allows it). Setups that take longer than SETUP_BUDGET_MS are
+ * skipped rather than waited on, since several list.c operations are
+ * linear scans and their setup cost grows quadratically.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "list.h"
+#include "clock.h"
+
+#define SETUP_BUDGET_MS 3000
+#define MAX_THREADS     64
+#define BENCH_ROOMS     64
+#define BENCH_BATCH     16          // rooms per user_join_rooms op
+
+/* list.c's locks live in server.c; the benchmark provides its own */
+int numReaders = 0;
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t rw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    int  max_entities;
+    int  threads;
+    int  duration_ms;
+    const char *only;
+} opt = { 1000000, 4, 300, NULL };
+
+/* Population built by setup, shared read-only by the op threads */
+static user_t **users;
+static room_t **rooms;
+static int      nusers, nrooms;
+static atomic_int next_user;        // unique ids for create_* ops
+static char    *listbuf;
+static size_t   listcap;
+
+static atomic_bool stop;
+
+struct worker {
+    pthread_t     tid;
+    int           id;
+    uint64_t      rng;
+    unsigned long ops;
+    uint64_t      end_ns;       // when the worker stopped (may run out of work early)
+    int           (*op)(struct worker *w);
+};
+
+static uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static void noop_cb(user_t *u, void *ctx) {
+    (void)u;
+    (*(unsigned long *)ctx)++;
+}
+
+/* ========== Setup helpers (return -1 when over budget) ========== */
+
+static int add_users(int n, uint64_t deadline) {
+    users = calloc(n, sizeof(user_t *));
+    if (!users) return -1;
+    char name[MAX_NAME];
+    for (nusers = 0; nusers < n; nusers++) {
+        snprintf(name, sizeof(name), "u%d", nusers);
+        users[nusers] = create_user(-1, name);   // -1: remove_user's close() is harmless
+        if (!users[nusers]) return -1;
+        if ((nusers & 1023) == 0 && now_ns() > deadline) return -1;
+    }
+    atomic_store(&next_user, n);
+    return 0;
+}
+
+static int add_rooms(int n, uint64_t deadline) {
+    rooms = calloc(n, sizeof(room_t *));
+    if (!rooms) return -1;
+    char name[MAX_NAME];
+    for (nrooms = 0; nrooms < n; nrooms++) {
+        snprintf(name, sizeof(name), "r%d", nrooms);
+        rooms[nrooms] = create_room(name);
+        if (!rooms[nrooms]) return -1;
+        if ((nrooms & 255) == 0 && now_ns() > deadline) return -1;
+    }
+    return 0;
+}
+
+static int setup_users(int n, uint64_t deadline) {
+    return add_users(n, deadline);
+}
+
+static int setup_rooms(int n, uint64_t deadline) {
+    return add_rooms(n, deadline);
+}
+
+static int setup_membership(int n, uint64_t deadline) {
+    if (add_users(n, deadline) < 0 || add_rooms(BENCH_ROOMS, deadline) < 0) return -1;
+    for (int i = 0; i < n; i++) {
+        user_join_room(users[i], rooms[i % BENCH_ROOMS]);
+        if ((i & 1023) == 0 && now_ns() > deadline) return -1;
+    }
+    return 0;
+}
+
+static int setup_listing(int n, uint64_t deadline) {
+    if (add_users(n, deadline) < 0) return -1;
+    listcap = (size_t)n * (MAX_NAME + 1) + 8;
+    listbuf = malloc(listcap);
+    return listbuf ? 0 : -1;
+}
+
+/* ========== Operations (one call = one op; return 0 when out of work) ========== */
+
+static int op_create_user(struct worker *w) {
+    (void)w;
+    char name[MAX_NAME];
+    snprintf(name, sizeof(name), "u%d", atomic_fetch_add(&next_user, 1));
+    return create_user(-1, name) != NULL;     // 0 once the arena is full
+}
+
+static int op_find_user(struct worker *w) {
+    char name[MAX_NAME];
+    snprintf(name, sizeof(name), "u%d", (int)(xorshift(&w->rng) % nusers));
+    find_user_by_name(name);
+    return 1;
+}
+
+static int op_create_room(struct worker *w) {
+    (void)w;
+    char name[MAX_NAME];
+    snprintf(name, sizeof(name), "n%d", atomic_fetch_add(&next_user, 1));
+    return create_room(name) != NULL;
+}
+
+static int op_join_room(struct worker *w) {
+    user_t *u = users[xorshift(&w->rng) % nusers];
+    room_t *r = rooms[xorshift(&w->rng) % BENCH_ROOMS];
+    user_join_room(u, r);
+    return 1;
+}
+
+/* One op = one batched join of BENCH_BATCH rooms (compare with 16x user_join_room) */
+static int op_join_rooms(struct worker *w) {
+    user_t *u = users[xorshift(&w->rng) % nusers];
+    char *names[BENCH_BATCH];
+    list_result_t res[BENCH_BATCH];
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        names[i] = rooms[xorshift(&w->rng) % BENCH_ROOMS]->name;
+    }
+    user_join_rooms(u, names, BENCH_BATCH, res);
+    return 1;
+}
+
+static int op_connect_dm(struct worker *w) {
+    user_t *a = users[xorshift(&w->rng) % nusers];
+    user_t *b = users[xorshift(&w->rng) % nusers];
+    user_connect_dm(a, b);
+    return 1;
+}
+
+/* Each thread removes users from its own stride of the population */
+static int op_remove_user(struct worker *w) {
+    int i = w->id + (int)w->ops * opt.threads;
+    if (i >= nusers) return 0;
+    remove_user(users[i]);
+    users[i] = NULL;
+    return 1;
+}
+
+static int op_for_each_user(struct worker *w) {
+    (void)w;
+    unsigned long n = 0;
+    for_each_user(noop_cb, &n);
+    return 1;
+}
+
+static int op_list_all_users(struct worker *w) {
+    (void)w;
+    list_all_users(listbuf, listcap);
+    return 1;
+}
+
+struct bench {
+    const char *name;
+    int (*setup)(int n, uint64_t deadline);
+    int (*op)(struct worker *w);
+    int max_n;          // a single op is too slow above this (0 = no limit)
+};
+
+static const struct bench benches[] = {
+    { "create_user",       setup_users,      op_create_user },
+    { "find_user_by_name", setup_users,      op_find_user },
+    { "create_room",       setup_rooms,      op_create_room },
+    { "user_join_room",    setup_membership, op_join_room },
+    { "user_join_rooms",   setup_membership, op_join_rooms },
+    { "user_connect_dm",   setup_users,      op_connect_dm },
+    { "remove_user",       setup_users,      op_remove_user },
+    { "for_each_user",     setup_users,      op_for_each_user },
+    { "list_all_users",    setup_listing,    op_list_all_users, 20000 },
+};
+
+/* ========== Cache misses via perf_event_open ========== */
+
+static int perf_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;               // count the worker threads too
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* ========== Runner ========== */
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (!w->op(w)) break;
+        w->ops++;
+    }
+    w->end_ns = now_ns();
+    return NULL;
+}
+
+static void teardown(void) {
+    cleanup_all();
+    free(users);
+    free(rooms);
+    free(listbuf);
+    users = NULL;
+    rooms = NULL;
+    listbuf = NULL;
+    nusers = nrooms = 0;
+}
+
+static void run_one(const struct bench *b, int n, int nthreads) {
+    printf("%-18s %8d %7d ", b->name, n, nthreads);
+    fflush(stdout);
+
+    if (b->max_n && n > b->max_n) {
+        printf("%14s   (one op is too slow above %d)\n", "skipped", b->max_n);
+        return;
+    }
+
+    uint64_t deadline = now_ns() + (uint64_t)SETUP_BUDGET_MS * 1000000ull;
+    if (b->setup(n, deadline) < 0) {
+        printf("%14s   (setup over %d ms)\n", "skipped", SETUP_BUDGET_MS);
+        teardown();
+        return;
+    }
+
+    struct worker w[MAX_THREADS];
+    atomic_store(&stop, false);
+
+    /* Opened per run so inherited counts from earlier threads don't leak in */
+    int pfd = perf_open();
+    if (pfd >= 0) {
+        ioctl(pfd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(pfd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        w[i] = (struct worker){ .id = i, .rng = 0x9E3779B97F4A7C15ull * (i + 1), .op = b->op };
+        pthread_create(&w[i].tid, NULL, worker_main, &w[i]);
+    }
+    sleep_ns((uint64_t)opt.duration_ms * 1000000ull);
+    atomic_store(&stop, true);
+
+    unsigned long ops = 0;
+    uint64_t end = t0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        ops += w[i].ops;
+        if (w[i].end_ns > end) end = w[i].end_ns;
+    }
+    double secs = (end - t0) / 1e9;
+
+    long long misses = -1;
+    if (pfd >= 0) {
+        ioctl(pfd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(pfd, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+        close(pfd);
+    }
+
+    printf("%14.0f", ops / secs);
+    if (misses >= 0 && ops > 0) printf("   %12.1f\n", (double)misses / ops);
+    else printf("   %12s\n", "n/a");
+
+    teardown();
+}
+
+int main(int argc, char **argv) {
+    int o;
+    while ((o = getopt(argc, argv, "n:t:d:b:h")) != -1) {
+        switch (o) {
+        case 'n': opt.max_entities = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'd': opt.duration_ms = atoi(optarg); break;
+        case 'b': opt.only = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n max_entities] [-t threads] [-d ms] [-b benchmark]\n",
+                    argv[0]);
+            exit(o == 'h' ? 0 : 1);
+        }
+    }
+    if (opt.threads < 1) opt.threads = 1;
+    if (opt.threads > MAX_THREADS) opt.threads = MAX_THREADS;
+
+    /* Room for the largest population plus what the create_* ops add */
+    uint32_t slots = (uint32_t)opt.max_entities * 2 + 65536;
+    if (slots > MAX_ARENA_SLOTS) slots = MAX_ARENA_SLOTS;
+    if (list_init(slots, slots) != 0) {
+        fprintf(stderr, "Error allocating arenas of %u slots\n", slots);
+        return 1;
+    }
+
+    printf("%-18s %8s %7s %14s   %12s\n", "benchmark", "entities", "threads", "ops/sec", "misses/op");
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (opt.only && strcmp(opt.only, benches[i].name) != 0) continue;
+
+        for (int n = 1000; n <= opt.max_entities; n *= 10) {
+            run_one(&benches[i], n, 1);
+            if (opt.threads > 1) run_one(&benches[i], n, opt.threads);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Monotonic time in nanoseconds (for rate limits, timers, latency) */
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Sleep for the given number of nanoseconds (restarts on EINTR) */
+static inline void sleep_ns(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (nanosleep(&ts, &ts) == -1) {
+        /* interrupted: keep sleeping for the remainder */
+    }
+}
+
+#endif
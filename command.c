@@ -0,0 +1,106 @@
+#include <string.h>
+#include <pthread.h>
+#include "command.h"
+
+#define CMD_TABLE_SIZE 64       // power of two, well above the command count
+#define CMD_MAX_LEN    16       // longer words are never commands
+
+static const char *cmd_names[CMD_NTYPES] = {
+    "create", "join", "leave", "connect", "disconnect", "batch",
+    "rooms", "users", "login", "help", "exit", "stats", "trace",
+    "subscribe", "unsubscribe", "pong", "msg", "log", "paste", "chat"
+};
+
+/* Extra spellings that map onto an existing command */
+static const struct { const char *name; cmd_type_t type; } cmd_aliases[] = {
+    { "logout", CMD_EXIT },
+};
+
+struct cmd_slot {
+    const char *name;           // NULL = empty
+    size_t      len;
+    cmd_type_t  type;
+};
+
+static struct cmd_slot table[CMD_TABLE_SIZE];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static inline int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* FNV-1a */
+static inline unsigned hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void insert(const char *name, cmd_type_t type) {
+    size_t len = strlen(name);
+    unsigned i = hash(name, len) & (CMD_TABLE_SIZE - 1);
+    while (table[i].name) i = (i + 1) & (CMD_TABLE_SIZE - 1);
+    table[i] = (struct cmd_slot){ name, len, type };
+}
+
+static void build_table(void) {
+    for (int t = 0; t < CMD_CHAT; t++) insert(cmd_names[t], t);
+    for (size_t a = 0; a < sizeof(cmd_aliases) / sizeof(cmd_aliases[0]); a++)
+        insert(cmd_aliases[a].name, cmd_aliases[a].type);
+}
+
+const char *cmd_first_word(const char *line, size_t *len) {
+    while (is_space(*line)) line++;
+    const char *end = line;
+    while (*end && !is_space(*end)) end++;
+    *len = end - line;
+    return line;
+}
+
+cmd_type_t cmd_lookup(const char *word, size_t len) {
+    if (len == 0 || len > CMD_MAX_LEN) return CMD_CHAT;
+    pthread_once(&table_once, build_table);
+
+    unsigned i = hash(word, len) & (CMD_TABLE_SIZE - 1);
+    while (table[i].name) {
+        if (table[i].len == len && memcmp(table[i].name, word, len) == 0)
+            return table[i].type;
+        i = (i + 1) & (CMD_TABLE_SIZE - 1);
+    }
+    return CMD_CHAT;
+}
+
+const char *cmd_name(cmd_type_t t) {
+    return (t >= 0 && t < CMD_NTYPES) ? cmd_names[t] : "unknown";
+}
+
+int cmd_split(char *line, char **argv, int max) {
+    int argc = 0;
+    char *p = line;
+    while (argc < max - 1) {
+        while (is_space(*p)) p++;
+        if (!*p) break;
+        argv[argc++] = p;
+        while (*p && !is_space(*p)) p++;
+        if (*p) *p++ = '\0';
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+int cmd_split_list(char *list, char **items, int max) {
+    int n = 0;
+    char *p = list;
+    while (*p) {
+        char *item = p;
+        while (*p && *p != ',') p++;
+        if (*p) *p++ = '\0';
+        if (!*item) continue;
+        if (n == max) return -1;
+        items[n++] = item;
+    }
+    return n;
+}
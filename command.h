@@ -0,0 +1,55 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+#define CMD_MAX_ARGS 80
+
+/* Command types; also the index into the dispatch and timing tables */
+typedef enum {
+    CMD_CREATE = 0,
+    CMD_JOIN,
+    CMD_LEAVE,
+    CMD_CONNECT,
+    CMD_DISCONNECT,
+    CMD_BATCH,
+    CMD_ROOMS,
+    CMD_USERS,
+    CMD_LOGIN,
+    CMD_HELP,
+    CMD_EXIT,
+    CMD_STATS,
+    CMD_TRACE,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_PONG,
+    CMD_MSG,
+    CMD_LOG,
+    CMD_PASTE,
+    CMD_CHAT,           // anything that is not a command
+    CMD_NTYPES
+} cmd_type_t;
+
+/*
+ * Find the first word of a NUL-terminated line without modifying it.
+ * Returns a pointer into line and its length (0 for a blank line).
+ */
+const char *cmd_first_word(const char *line, size_t *len);
+
+/* Hashed lookup of a word slice; anything unknown is CMD_CHAT */
+cmd_type_t  cmd_lookup(const char *word, size_t len);
+const char *cmd_name(cmd_type_t t);
+
+/*
+ * Split line in place into whitespace-separated words: separators are
+ * overwritten with NULs and argv points into line. argv[argc] is NULL.
+ */
+int         cmd_split(char *line, char **argv, int max);
+
+/*
+ * Split a comma-separated list ("a,b,c") in place, skipping empty
+ * items. Returns the item count, or -1 if there are more than max.
+ */
+int         cmd_split_list(char *list, char **items, int max);
+
+#endif
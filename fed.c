@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "fed.h"
+#include "log.h"
+
+static int relay_fd = -1;
+static uint32_t my_node = 0;
+static pthread_mutex_t relay_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Snapshot requests, served by snapshot_writer (see request_snapshot) */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snap_cond = PTHREAD_COND_INITIALIZER;
+static bool snap_wanted = false;
+
+/* Growable buffer of outgoing frames (used for state snapshots) */
+struct frame_buf {
+    char  *data;
+    size_t len;
+    size_t cap;
+};
+
+static int write_full(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Encode one frame (header + NUL-terminated fields) into fb. Only the
+ * last present field (the free text, if any) is truncated to fit.
+ */
+static void frame_append3(struct frame_buf *fb, enum fed_type type,
+                          const char *a, const char *b, const char *c) {
+    size_t la = a ? strlen(a) + 1 : 0;
+    size_t lb = b ? strlen(b) + 1 : 0;
+    size_t lc = c ? strlen(c) + 1 : 0;
+    if (la + lb + lc > FED_MAX_PAYLOAD) {
+        if (lc) lc = (la + lb < FED_MAX_PAYLOAD) ? FED_MAX_PAYLOAD - la - lb : 0;
+        else lb = (la < FED_MAX_PAYLOAD) ? FED_MAX_PAYLOAD - la : 0;
+    }
+
+    size_t need = sizeof(struct fed_hdr) + la + lb + lc;
+    if (fb->len + need > fb->cap) {
+        size_t cap = fb->cap ? fb->cap * 2 : 1024;
+        while (cap < fb->len + need) cap *= 2;
+        char *p = realloc(fb->data, cap);
+        if (!p) return;
+        fb->data = p;
+        fb->cap = cap;
+    }
+
+    struct fed_hdr h = { .len = la + lb + lc, .origin = my_node, .type = type };
+    char *out = fb->data + fb->len;
+    memcpy(out, &h, sizeof(h));
+    if (la) memcpy(out + sizeof(h), a, la);
+    if (lb) {
+        memcpy(out + sizeof(h) + la, b, lb);
+        out[sizeof(h) + la + lb - 1] = '\0';    // in case b was truncated
+    }
+    if (lc) {
+        memcpy(out + sizeof(h) + la + lb, c, lc);
+        out[need - 1] = '\0';                   // in case c was truncated
+    }
+    fb->len += need;
+}
+
+static void frame_append(struct frame_buf *fb, enum fed_type type,
+                         const char *a, const char *b) {
+    frame_append3(fb, type, a, b, NULL);
+}
+
+static void frame_send(struct frame_buf *fb) {
+    if (fb->len == 0) return;
+
+    pthread_mutex_lock(&relay_write_lock);
+    if (relay_fd >= 0) {
+        write_full(relay_fd, fb->data, fb->len);
+    }
+    pthread_mutex_unlock(&relay_write_lock);
+}
+
+bool fed_enabled(void) {
+    return relay_fd >= 0;
+}
+
+void fed_publish(enum fed_type type, const char *a, const char *b) {
+    if (relay_fd < 0) return;
+
+    struct frame_buf fb = { 0 };
+    frame_append(&fb, type, a, b);
+    frame_send(&fb);
+    free(fb.data);
+}
+
+void fed_publish_msg(const char *from, const char *to, const char *text) {
+    if (relay_fd < 0) return;
+
+    struct frame_buf fb = { 0 };
+    frame_append3(&fb, FED_PRIVMSG, from, to, text);
+    frame_send(&fb);
+    free(fb.data);
+}
+
+/* ========== State snapshots ========== */
+
+static void snapshot_user_cb(user_t *u, void *ctx) {
+    struct frame_buf *fb = ctx;
+    if (u->node != 0) return;           // only announce our own users
+
+    frame_append(fb, FED_USER_ADD, u->username, NULL);
+    if (single_membership) {
+        if (u->room) frame_append(fb, FED_JOIN, u->username, u->room->name);
+        if (u->dm) frame_append(fb, FED_DM_ADD, u->username, u->dm->username);
+        return;
+    }
+    for (room_list_t *rl = u->rooms; rl; rl = rl->next) {
+        frame_append(fb, FED_JOIN, u->username, rl->room->name);
+    }
+    for (dm_list_t *dl = u->dms; dl; dl = dl->next) {
+        frame_append(fb, FED_DM_ADD, u->username, dl->peer->username);
+    }
+}
+
+static void snapshot_room_cb(room_t *r, void *ctx) {
+    frame_append(ctx, FED_ROOM_ADD, r->name, NULL);
+}
+
+/* Announce every local room and user (answer to another node's HELLO) */
+static void publish_snapshot(void) {
+    struct frame_buf fb = { 0 };
+    for_each_room(snapshot_room_cb, &fb);
+    for_each_user(snapshot_user_cb, &fb);
+    frame_send(&fb);
+    free(fb.data);
+}
+
+/*
+ * Snapshots can be large, and the relay writes to us from the same
+ * thread that reads from us, so they must never be written from
+ * fed_reader: with both socket buffers full neither side would read
+ * again. A separate writer sends them; requests that pile up while it
+ * is busy are served by one (fresher) snapshot.
+ */
+static void request_snapshot(void) {
+    pthread_mutex_lock(&snap_lock);
+    snap_wanted = true;
+    pthread_cond_signal(&snap_cond);
+    pthread_mutex_unlock(&snap_lock);
+}
+
+static void *snapshot_writer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&snap_lock);
+    while (1) {
+        while (!snap_wanted) pthread_cond_wait(&snap_cond, &snap_lock);
+        snap_wanted = false;
+        pthread_mutex_unlock(&snap_lock);
+
+        publish_snapshot();
+
+        pthread_mutex_lock(&snap_lock);
+    }
+    return NULL;
+}
+
+void fed_publish_user(user_t *u) {
+    if (relay_fd < 0 || !u) return;
+
+    struct frame_buf fb = { 0 };
+    snapshot_user_cb(u, &fb);
+    frame_send(&fb);
+    free(fb.data);
+}
+
+/* ========== Applying remote events ========== */
+
+struct proxy_query {
+    uint32_t node;
+    bool any_remote;    // match proxies of every node (node is ignored)
+    user_t **all;       // collects every matching proxy
+    size_t n, cap;
+};
+
+static void proxy_query_cb(user_t *u, void *ctx) {
+    struct proxy_query *q = ctx;
+    bool match = q->any_remote ? (u->node != 0) : (u->node == q->node);
+    if (match && q->n < q->cap) q->all[q->n++] = u;
+}
+
+/*
+ * Hashed name lookup restricted to node. Proxies are only removed by
+ * the reader thread, so the pointer stays valid while it applies a frame.
+ */
+static user_t *find_proxy(uint32_t node, const char *name) {
+    return find_user_by_name_node(name, node);
+}
+
+/* Drop every proxy belonging to node (or to all nodes when node == 0) */
+static void drop_proxies(uint32_t node) {
+    user_t *batch[64];
+    size_t n;
+
+    do {
+        struct proxy_query q = { .node = node, .any_remote = (node == 0),
+                                 .all = batch, .cap = 64 };
+        for_each_user(proxy_query_cb, &q);
+        n = q.n;
+        for (size_t i = 0; i < n; i++) {
+            remove_user(batch[i]);
+        }
+    } while (n == 64);
+}
+
+static void apply_frame(const struct fed_hdr *h, char *payload) {
+    /* Split the payload into its (up to three) fields */
+    const char *f[3] = { "", "", "" };
+    size_t off = 0;
+    for (int i = 0; i < 3 && off < h->len; i++) {
+        f[i] = payload + off;
+        off += strnlen(payload + off, h->len - off) + 1;
+    }
+
+    user_t *p, *q;
+    room_t *r;
+
+    switch (h->type) {
+    case FED_HELLO:
+        request_snapshot();
+        break;
+    case FED_USER_ADD:
+        if (!find_proxy(h->origin, f[0])) {
+            p = create_user(-1, f[0]);
+            if (p) p->node = h->origin;
+        }
+        break;
+    case FED_USER_DEL:
+        remove_user(find_proxy(h->origin, f[0]));
+        break;
+    case FED_RENAME:
+        user_rename(find_proxy(h->origin, f[0]), f[1]);
+        break;
+    case FED_ROOM_ADD:
+        create_room(f[0]);
+        break;
+    case FED_JOIN:
+        p = find_proxy(h->origin, f[0]);
+        r = create_room(f[1]);
+        user_join_room(p, r);
+        break;
+    case FED_LEAVE:
+        user_leave_room(find_proxy(h->origin, f[0]), find_room(f[1]));
+        break;
+    case FED_DM_ADD:
+    case FED_DM_DEL:
+        p = find_proxy(h->origin, f[0]);
+        q = find_user_by_name(f[1]);
+        if (h->type == FED_DM_ADD) user_connect_dm(p, q);
+        else user_disconnect_dm(p, q);
+        break;
+    case FED_MSG:
+        p = find_proxy(h->origin, f[0]);
+        if (p) broadcast_message(p, f[1]);
+        break;
+    case FED_PRIVMSG:
+        p = find_proxy(h->origin, f[0]);
+        if (p) deliver_direct(p, f[1], f[2]);
+        break;
+    case FED_NODE_DOWN:
+        drop_proxies(h->origin);
+        break;
+    default:
+        break;
+    }
+}
+
+static void *fed_reader(void *arg) {
+    (void)arg;
+    struct fed_hdr h;
+    char *payload = malloc(FED_MAX_PAYLOAD + 1);
+
+    while (payload && read_full(relay_fd, &h, sizeof(h)) == 0) {
+        if (h.len > FED_MAX_PAYLOAD || read_full(relay_fd, payload, h.len) < 0) break;
+        payload[h.len] = '\0';
+        if (h.origin == my_node) continue;
+        apply_frame(&h, payload);
+    }
+
+    log_warn("[Federation] Lost connection to relay; running standalone");
+    pthread_mutex_lock(&relay_write_lock);
+    close(relay_fd);
+    relay_fd = -1;
+    pthread_mutex_unlock(&relay_write_lock);
+
+    /* Remote users are no longer reachable */
+    drop_proxies(0);
+    free(payload);
+    return NULL;
+}
+
+int fed_start(const char *relay_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, relay_path, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    relay_fd = fd;
+    my_node = (uint32_t)getpid();
+
+    pthread_t tid, snap_tid;
+    if (pthread_create(&snap_tid, NULL, snapshot_writer, NULL) != 0) {
+        close(fd);
+        relay_fd = -1;
+        return -1;
+    }
+    pthread_detach(snap_tid);
+
+    if (pthread_create(&tid, NULL, fed_reader, NULL) != 0) {
+        close(fd);
+        relay_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+
+    /* Say hello (peers answer with their state), then announce ours */
+    fed_publish(FED_HELLO, NULL, NULL);
+    request_snapshot();
+    return 0;
+}
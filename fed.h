@@ -0,0 +1,23 @@
+#ifndef FED_H
+#define FED_H
+
+#include "list.h"
+#include "relay.h"
+
+/*
+ * Federation: several server processes share one user/room namespace by
+ * exchanging state changes over the local relay (see relay.c).
+ *
+ * Users on other nodes are mirrored locally as proxy users (socket -1,
+ * node != 0) with their rooms and DM links, so listing and fan-out work
+ * unchanged. The fed_publish_* calls are no-ops when federation is off.
+ */
+
+int  fed_start(const char *relay_path);     // connect and start the reader thread
+bool fed_enabled(void);
+
+void fed_publish(enum fed_type type, const char *a, const char *b);
+void fed_publish_user(user_t *u);           // user plus all its rooms and DMs
+void fed_publish_msg(const char *from, const char *to, const char *text);  // FED_PRIVMSG
+
+#endif
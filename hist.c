@@ -0,0 +1,44 @@
+#include "hist.h"
+
+static unsigned hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (unsigned)v;
+
+    unsigned msb = 63 - __builtin_clzll(v);
+    unsigned shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (unsigned)((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Smallest value that lands in bucket idx */
+static uint64_t hist_value(unsigned idx) {
+    if (idx < HIST_SUB) return idx;
+
+    unsigned shift = idx / HIST_SUB - 1;
+    return ((uint64_t)HIST_SUB + idx % HIST_SUB) << shift;
+}
+
+void hist_record(histogram_t *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->buckets[hist_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+
+    unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak(&h->max, &max, value)) {
+        /* max reloaded by the failed CAS */
+    }
+}
+
+uint64_t hist_percentile(histogram_t *h, double p) {
+    uint64_t total = atomic_load(&h->count);
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p * (double)total);
+    if (rank >= total) rank = total - 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen > rank) return hist_value(i);
+    }
+    return atomic_load(&h->max);
+}
@@ -0,0 +1,26 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * HDR-style log-linear histogram: values below HIST_SUB get their own
+ * bucket, above that each power of two is split into HIST_SUB buckets,
+ * so every recorded value is within ~6% of its bucket. Lock-free.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+typedef struct histogram {
+    atomic_ulong buckets[HIST_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum;
+    atomic_ulong max;
+} histogram_t;
+
+void     hist_record(histogram_t *h, uint64_t value);
+uint64_t hist_percentile(histogram_t *h, double p);
+
+#endif
@@ -3,6 +3,9 @@
 #include <string.h>
 #include <unistd.h>
 #include "list.h"
+#include "clock.h"
+#include "stats.h"
+#include "trace.h"
 
 /* These come from server.c */
 extern int numReaders;
@@ -13,15 +16,23 @@ extern pthread_mutex_t rw_lock;
 user_t *users_head = NULL;
 room_t *rooms_head = NULL;
 
+bool single_membership = false;
+
+static void (*observer)(list_event_t ev, const char *a, const char *b);
+
 /* ========== Reader / Writer lock helpers ========== */
 
 static void begin_read(void) {
+    uint64_t t0 = now_ns();
     pthread_mutex_lock(&mutex);
     numReaders++;
     if (numReaders == 1) {
         pthread_mutex_lock(&rw_lock);   // first reader locks writers out
     }
     pthread_mutex_unlock(&mutex);
+    uint64_t t1 = now_ns();
+    hist_record(&stats.lock_read_wait_ns, t1 - t0);
+    if (trace_on()) trace_span(TR_LOCK_READ, t0, t1, 0);
 }
 
 static void end_read(void) {
@@ -34,17 +45,203 @@ static void end_read(void) {
 }
 
 static void begin_write(void) {
+    uint64_t t0 = now_ns();
     pthread_mutex_lock(&rw_lock);
+    uint64_t t1 = now_ns();
+    hist_record(&stats.lock_write_wait_ns, t1 - t0);
+    if (trace_on()) trace_span(TR_LOCK_WRITE, t0, t1, 0);
 }
 
 static void end_write(void) {
     pthread_mutex_unlock(&rw_lock);
 }
 
+/* ========== Change events ========== */
+
+void list_set_observer(void (*cb)(list_event_t ev, const char *a, const char *b)) {
+    observer = cb;
+}
+
+/* Callers copy names out under the lock and notify after dropping it */
+static inline void notify(list_event_t ev, const char *a, const char *b) {
+    if (observer) observer(ev, a, b);
+}
+
+/* ========== Arenas and handles ========== */
+
+struct arena {
+    char     *slots;
+    size_t    size;         // bytes per slot
+    uint32_t  cap;          // slots including the unused slot 0
+    uint32_t *gens;         // per-slot generation, bumped on free
+    uint32_t *free;         // stack of free slot indices
+    uint32_t  nfree;
+    atomic_ulong used;      // slots handed out; read without the lock
+};
+
+static struct arena user_arena, room_arena;
+
+static int arena_init(struct arena *a, size_t size, uint32_t n) {
+    if (n < 1 || n > MAX_ARENA_SLOTS) return -1;
+    a->size = size;
+    a->cap = n + 1;
+    a->slots = calloc(a->cap, size);
+    a->gens = calloc(a->cap, sizeof(uint32_t));
+    a->free = malloc(a->cap * sizeof(uint32_t));
+    if (!a->slots || !a->gens || !a->free) return -1;
+
+    /* Pop order hands out low indices first, keeping the hot part dense */
+    a->nfree = 0;
+    for (uint32_t i = a->cap - 1; i >= 1; i--) a->free[a->nfree++] = i;
+    atomic_store(&a->used, 0);
+    return 0;
+}
+
+/* Caller holds the write lock */
+static void *arena_alloc(struct arena *a) {
+    if (a->nfree == 0) return NULL;
+    uint32_t i = a->free[--a->nfree];
+    void *p = a->slots + (size_t)i * a->size;
+    memset(p, 0, a->size);
+    atomic_fetch_add_explicit(&a->used, 1, memory_order_relaxed);
+    return p;
+}
+
+static uint32_t arena_index(const struct arena *a, const void *p) {
+    return (uint32_t)(((const char *)p - a->slots) / a->size);
+}
+
+/* Caller holds the write lock */
+static void arena_free(struct arena *a, void *p) {
+    uint32_t i = arena_index(a, p);
+    a->gens[i] = (a->gens[i] + 1) & (0xFFFFFFFFu >> HANDLE_INDEX_BITS);
+    a->free[a->nfree++] = i;
+    atomic_fetch_sub_explicit(&a->used, 1, memory_order_relaxed);
+}
+
+unsigned long list_user_count(void) {
+    return atomic_load_explicit(&user_arena.used, memory_order_relaxed);
+}
+
+unsigned long list_room_count(void) {
+    return atomic_load_explicit(&room_arena.used, memory_order_relaxed);
+}
+
+static handle_t arena_handle(const struct arena *a, const void *p) {
+    if (!p) return HANDLE_NONE;
+    uint32_t i = arena_index(a, p);
+    return (a->gens[i] << HANDLE_INDEX_BITS) | i;
+}
+
+static void *arena_get(const struct arena *a, handle_t h) {
+    uint32_t i = h & HANDLE_INDEX_MASK;
+    if (i == 0 || i >= a->cap) return NULL;
+    if (a->gens[i] != h >> HANDLE_INDEX_BITS) return NULL;
+    return a->slots + (size_t)i * a->size;
+}
+
+/* ========== User name index ========== */
+
+/*
+ * Users hashed by name, chained through user_t.name_next and sized to
+ * the user arena so chains stay short. Guarded by the list lock like the
+ * global lists. Names are not unique; a lookup finds the most recently
+ * inserted (created or renamed) user with the name.
+ */
+static user_t **name_buckets;
+static uint32_t name_mask;
+
+/* FNV-1a */
+static user_t **name_bucket(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return &name_buckets[h & name_mask];
+}
+
+/* Caller holds the write lock */
+static void name_insert(user_t *u) {
+    user_t **b = name_bucket(u->username);
+    u->name_next = *b;
+    *b = u;
+}
+
+/* Caller holds the write lock */
+static void name_remove(user_t *u) {
+    for (user_t **p = name_bucket(u->username); *p; p = &(*p)->name_next) {
+        if (*p == u) {
+            *p = u->name_next;
+            return;
+        }
+    }
+}
+
+/* Caller holds either lock */
+static user_t *name_lookup(const char *name) {
+    user_t *u = *name_bucket(name);
+    while (u && strcmp(u->username, name) != 0) u = u->name_next;
+    return u;
+}
+
+/* Same, but only users owned by node (names may repeat across nodes) */
+static user_t *name_lookup_node(const char *name, uint32_t node) {
+    user_t *u = *name_bucket(name);
+    while (u && (u->node != node || strcmp(u->username, name) != 0)) u = u->name_next;
+    return u;
+}
+
+int list_init(uint32_t max_users, uint32_t max_rooms) {
+    if (arena_init(&user_arena, sizeof(user_t), max_users) < 0) return -1;
+    if (arena_init(&room_arena, sizeof(room_t), max_rooms) < 0) return -1;
+
+    uint32_t nb = 64;
+    while (nb < max_users) nb <<= 1;
+    name_buckets = calloc(nb, sizeof(user_t *));
+    if (!name_buckets) return -1;
+    name_mask = nb - 1;
+    return 0;
+}
+
+handle_t user_handle(const user_t *u) { return arena_handle(&user_arena, u); }
+user_t  *user_get(handle_t h)         { return arena_get(&user_arena, h); }
+handle_t room_handle(const room_t *r) { return arena_handle(&room_arena, r); }
+room_t  *room_get(handle_t h)         { return arena_get(&room_arena, h); }
+
 /* ========== Internal small helpers ========== */
 
+/*
+ * Membership list nodes are all two pointers wide; freed ones are kept
+ * on a free list (guarded by the write lock) instead of going back to
+ * the allocator, so steady-state joins and disconnects do not malloc.
+ */
+struct free_node {
+    struct free_node *unused;
+    struct free_node *next;
+};
+
+static struct free_node *free_nodes = NULL;
+
+_Static_assert(sizeof(user_list_t) == sizeof(struct free_node), "list node size");
+_Static_assert(sizeof(room_list_t) == sizeof(struct free_node), "list node size");
+_Static_assert(sizeof(dm_list_t) == sizeof(struct free_node), "list node size");
+
+static void *node_alloc(void) {
+    struct free_node *n = free_nodes;
+    if (!n) return malloc(sizeof(struct free_node));
+    free_nodes = n->next;
+    return n;
+}
+
+static void node_free(void *p) {
+    struct free_node *n = p;
+    n->next = free_nodes;
+    free_nodes = n;
+}
+
 static user_list_t *user_list_append(user_list_t *head, user_t *u) {
-    user_list_t *node = malloc(sizeof(user_list_t));
+    user_list_t *node = node_alloc();
     if (!node) return head;
     node->user = u;
     node->next = NULL;
@@ -58,7 +255,7 @@ static user_list_t *user_list_append(user_list_t *head, user_t *u) {
 }
 
 static room_list_t *room_list_append(room_list_t *head, room_t *r) {
-    room_list_t *node = malloc(sizeof(room_list_t));
+    room_list_t *node = node_alloc();
     if (!node) return head;
     node->room = r;
     node->next = NULL;
@@ -72,7 +269,7 @@ static room_list_t *room_list_append(room_list_t *head, room_t *r) {
 }
 
 static dm_list_t *dm_list_append(dm_list_t *head, user_t *peer) {
-    dm_list_t *node = malloc(sizeof(dm_list_t));
+    dm_list_t *node = node_alloc();
     if (!node) return head;
     node->peer = peer;
     node->next = NULL;
@@ -95,7 +292,7 @@ static user_list_t *user_list_remove(user_list_t *head, user_t *u) {
         if (cur->user == u) {
             if (prev) prev->next = cur->next;
             else head = cur->next;
-            free(cur);
+            node_free(cur);
             break;
         }
         prev = cur;
@@ -112,7 +309,7 @@ static room_list_t *room_list_remove(room_list_t *head, room_t *r) {
         if (cur->room == r) {
             if (prev) prev->next = cur->next;
             else head = cur->next;
-            free(cur);
+            node_free(cur);
             break;
         }
         prev = cur;
@@ -129,7 +326,7 @@ static dm_list_t *dm_list_remove(dm_list_t *head, user_t *peer) {
         if (cur->peer == peer) {
             if (prev) prev->next = cur->next;
             else head = cur->next;
-            free(cur);
+            node_free(cur);
             break;
         }
         prev = cur;
@@ -141,21 +338,33 @@ static dm_list_t *dm_list_remove(dm_list_t *head, user_t *peer) {
 /* ========== User operations ========== */
 
 user_t *create_user(int socket, const char *username) {
-    user_t *u = malloc(sizeof(user_t));
-    if (!u) return NULL;
+    char name[MAX_NAME];
+    begin_write();
+    user_t *u = arena_alloc(&user_arena);
+    if (!u) {
+        end_write();
+        return NULL;
+    }
 
     u->socket = socket;
+    u->node = 0;
     strncpy(u->username, username, MAX_NAME - 1);
     u->username[MAX_NAME - 1] = '\0';
     u->rooms = NULL;
     u->dms = NULL;
-    u->next = NULL;
+    u->room = NULL;
+    u->dm = NULL;
+    u->stream = NULL;
+    batch_init(&u->batch, &u->out);
+    outq_init(&u->out, socket);
 
-    begin_write();
     u->next = users_head;
     users_head = u;
+    name_insert(u);
+    strcpy(name, u->username);
     end_write();
 
+    notify(LIST_USER_ADD, name, NULL);
     return u;
 }
 
@@ -176,35 +385,59 @@ user_t *find_user_by_socket(int socket) {
 }
 
 user_t *find_user_by_name(const char *username) {
-    user_t *result = NULL;
+    begin_read();
+    user_t *result = name_lookup(username);
+    end_read();
+    return result;
+}
 
+user_t *find_user_by_name_node(const char *username, uint32_t node) {
     begin_read();
-    user_t *cur = users_head;
-    while (cur) {
-        if (strcmp(cur->username, username) == 0) {
-            result = cur;
-            break;
-        }
-        cur = cur->next;
-    }
+    user_t *result = name_lookup_node(username, node);
     end_read();
     return result;
 }
 
+bool with_user_by_name(const char *username, void (*cb)(user_t *u, void *ctx), void *ctx) {
+    begin_read();
+    user_t *u = name_lookup(username);
+    if (u && cb) cb(u, ctx);
+    end_read();
+    return u != NULL;
+}
+
 void user_rename(user_t *u, const char *newname) {
     if (!u || !newname) return;
 
+    char oldname[MAX_NAME], name[MAX_NAME];
     begin_write();
+    strcpy(oldname, u->username);
+    name_remove(u);
     strncpy(u->username, newname, MAX_NAME - 1);
     u->username[MAX_NAME - 1] = '\0';
+    name_insert(u);
+    strcpy(name, u->username);
     end_write();
+
+    notify(LIST_USER_RENAME, oldname, name);
+}
+
+void with_users(const handle_t *hs, int n, void (*cb)(user_t *u, int i, void *ctx), void *ctx) {
+    begin_read();
+    for (int i = 0; i < n; i++) {
+        user_t *u = user_get(hs[i]);
+        if (u) cb(u, i, ctx);
+    }
+    end_read();
 }
 
 /* Remove user from all lists and free it */
 void remove_user(user_t *u) {
     if (!u) return;
 
+    char name[MAX_NAME];
     begin_write();
+    strcpy(name, u->username);
 
     /* 1) Remove from global user list */
     user_t *cur = users_head;
@@ -218,19 +451,28 @@ void remove_user(user_t *u) {
         prev = cur;
         cur = cur->next;
     }
+    name_remove(u);
 
-    /* 2) Remove from all rooms' user lists */
-    room_t *r = rooms_head;
-    while (r) {
-        r->users = user_list_remove(r->users, u);
-        r = r->next;
-    }
+    if (single_membership) {
+        /* 2+3) Only one room to leave; clear DM pointers aimed at u */
+        if (u->room) u->room->users = user_list_remove(u->room->users, u);
+        for (cur = users_head; cur; cur = cur->next) {
+            if (cur->dm == u) cur->dm = NULL;
+        }
+    } else {
+        /* 2) Remove from all rooms' user lists */
+        room_t *r = rooms_head;
+        while (r) {
+            r->users = user_list_remove(r->users, u);
+            r = r->next;
+        }
 
-    /* 3) Remove u from everyone else's DM lists */
-    cur = users_head;
-    while (cur) {
-        cur->dms = dm_list_remove(cur->dms, u);
-        cur = cur->next;
+        /* 3) Remove u from everyone else's DM lists */
+        cur = users_head;
+        while (cur) {
+            cur->dms = dm_list_remove(cur->dms, u);
+            cur = cur->next;
+        }
     }
 
     /* 4) Free user's own room and DM lists */
@@ -238,38 +480,54 @@ void remove_user(user_t *u) {
     while (rl) {
         room_list_t *tmp = rl;
         rl = rl->next;
-        free(tmp);
+        node_free(tmp);
     }
 
     dm_list_t *dl = u->dms;
     while (dl) {
         dm_list_t *tmp = dl;
         dl = dl->next;
-        free(tmp);
+        node_free(tmp);
     }
 
+    batch_destroy(&u->batch);
+    outq_destroy(&u->out);
+
     /* Close socket just in case */
     close(u->socket);
-
-    free(u);
+    arena_free(&user_arena, u);    // outstanding handles go stale here
 
     end_write();
+
+    notify(LIST_USER_DEL, name, NULL);
 }
 
 /* ========== Room operations ========== */
 
-room_t *find_room(const char *room_name) {
-    room_t *result = NULL;
+/* Caller holds either lock */
+static room_t *room_lookup(const char *room_name) {
+    room_t *cur = rooms_head;
+    while (cur && strcmp(cur->name, room_name) != 0) cur = cur->next;
+    return cur;
+}
 
+/* Caller holds the write lock; NULL when the room arena is full */
+static room_t *room_create_locked(const char *room_name) {
+    room_t *r = arena_alloc(&room_arena);
+    if (!r) return NULL;
+
+    strncpy(r->name, room_name, MAX_NAME - 1);
+    r->name[MAX_NAME - 1] = '\0';
+    r->users = NULL;
+    atomic_store(&r->batch_ms, 0);
+    r->next = rooms_head;
+    rooms_head = r;
+    return r;
+}
+
+room_t *find_room(const char *room_name) {
     begin_read();
-    room_t *cur = rooms_head;
-    while (cur) {
-        if (strcmp(cur->name, room_name) == 0) {
-            result = cur;
-            break;
-        }
-        cur = cur->next;
-    }
+    room_t *result = room_lookup(room_name);
     end_read();
     return result;
 }
@@ -280,28 +538,23 @@ room_t *create_room(const char *room_name) {
     begin_write();
 
     /* If it already exists, return existing one */
-    room_t *cur = rooms_head;
-    while (cur) {
-        if (strcmp(cur->name, room_name) == 0) {
-            end_write();
-            return cur;
-        }
-        cur = cur->next;
+    room_t *r = room_lookup(room_name);
+    if (r) {
+        end_write();
+        return r;
     }
 
-    room_t *r = malloc(sizeof(room_t));
+    r = room_create_locked(room_name);
     if (!r) {
         end_write();
         return NULL;
     }
 
-    strncpy(r->name, room_name, MAX_NAME - 1);
-    r->name[MAX_NAME - 1] = '\0';
-    r->users = NULL;
-    r->next = rooms_head;
-    rooms_head = r;
-
+    char name[MAX_NAME];
+    strcpy(name, r->name);
     end_write();
+
+    notify(LIST_ROOM_ADD, name, NULL);
     return r;
 }
 
@@ -328,76 +581,239 @@ void delete_room(room_t *room) {
     while (ul) {
         user_list_t *tmp = ul;
         ul = ul->next;
-        free(tmp);
+        node_free(tmp);
     }
 
-    free(room);
+    arena_free(&room_arena, room);
+
+    end_write();
+}
+
+void room_set_batch(room_t *r, int window_ms) {
+    if (!r) return;
 
+    if (window_ms < 0) window_ms = 0;
+    if (window_ms > MAX_BATCH_MS) window_ms = MAX_BATCH_MS;
+
+    begin_write();
+    atomic_store(&r->batch_ms, window_ms);
     end_write();
 }
 
 /* ========== Relationships: rooms ========== */
 
+/*
+ * Multi-membership join; caller holds the write lock. Returns false if
+ * u was already in r.
+ */
+static bool join_locked(user_t *u, room_t *r) {
+    for (room_list_t *rl = u->rooms; rl; rl = rl->next) {
+        if (rl->room == r) return false;
+    }
+    u->rooms = room_list_append(u->rooms, r);
+    r->users = user_list_append(r->users, u);
+    return true;
+}
+
+/* Caller holds the write lock; returns false if u was not in r */
+static bool leave_locked(user_t *u, room_t *r) {
+    bool member = false;
+    if (single_membership) {
+        member = u->room == r;
+        if (member) u->room = NULL;
+    } else {
+        for (room_list_t *rl = u->rooms; rl && !member; rl = rl->next) {
+            member = rl->room == r;
+        }
+        u->rooms = room_list_remove(u->rooms, r);
+    }
+    if (member) r->users = user_list_remove(r->users, u);
+    return member;
+}
+
 void user_join_room(user_t *u, room_t *r) {
     if (!u || !r) return;
 
+    char name[MAX_NAME], room[MAX_NAME], oldroom[MAX_NAME];
     begin_write();
 
-    /* Check if already in room (by scanning user's room list) */
-    room_list_t *rl = u->rooms;
-    while (rl) {
-        if (rl->room == r) {
+    if (single_membership) {
+        /* Move: leave the previous room under the same lock */
+        if (u->room == r) {
             end_write();
-            return;    // already a member
+            return;
         }
-        rl = rl->next;
-    }
+        oldroom[0] = '\0';
+        if (u->room) {
+            strcpy(oldroom, u->room->name);
+            u->room->users = user_list_remove(u->room->users, u);
+        }
+        u->room = r;
+        r->users = user_list_append(r->users, u);
+        strcpy(name, u->username);
+        strcpy(room, r->name);
+        end_write();
 
-    /* Add to user's room list */
-    u->rooms = room_list_append(u->rooms, r);
+        if (oldroom[0]) notify(LIST_LEAVE, name, oldroom);
+        notify(LIST_JOIN, name, room);
+        return;
+    }
 
-    /* Add to room's user list */
-    r->users = user_list_append(r->users, u);
+    if (!join_locked(u, r)) {
+        end_write();
+        return;    // already a member
+    }
 
+    strcpy(name, u->username);
+    strcpy(room, r->name);
     end_write();
+
+    notify(LIST_JOIN, name, room);
 }
 
 void user_leave_room(user_t *u, room_t *r) {
     if (!u || !r) return;
 
+    char name[MAX_NAME], room[MAX_NAME];
     begin_write();
-    u->rooms = room_list_remove(u->rooms, r);
-    r->users = user_list_remove(r->users, u);
+    bool member = leave_locked(u, r);
+    strcpy(name, u->username);
+    strcpy(room, r->name);
     end_write();
+
+    if (member) notify(LIST_LEAVE, name, room);
 }
 
 /* ========== Relationships: DMs (one-way) ========== */
 
+/* Caller holds the write lock; returns false if the link already existed */
+static bool connect_locked(user_t *from, user_t *to) {
+    if (single_membership) {
+        if (from->dm == to) return false;
+        from->dm = to;      // replaces any previous DM
+        return true;
+    }
+
+    /* Check if already connected */
+    for (dm_list_t *dl = from->dms; dl; dl = dl->next) {
+        if (dl->peer == to) return false;    // already has one-way DM
+    }
+    from->dms = dm_list_append(from->dms, to);
+    return true;
+}
+
 void user_connect_dm(user_t *from, user_t *to) {
     if (!from || !to || from == to) return;
 
     begin_write();
+    connect_locked(from, to);
+    end_write();
+}
 
-    /* Check if already connected */
-    dm_list_t *dl = from->dms;
-    while (dl) {
+/* Caller holds the write lock; returns false if there was no such link */
+static bool disconnect_locked(user_t *from, user_t *to) {
+    if (single_membership) {
+        if (from->dm != to) return false;
+        from->dm = NULL;
+        return true;
+    }
+    for (dm_list_t *dl = from->dms; dl; dl = dl->next) {
         if (dl->peer == to) {
-            end_write();
-            return;    // already has one-way DM
+            from->dms = dm_list_remove(from->dms, to);
+            return true;
         }
-        dl = dl->next;
     }
+    return false;
+}
 
-    from->dms = dm_list_append(from->dms, to);
+void user_disconnect_dm(user_t *from, user_t *to) {
+    if (!from || !to) return;
 
+    begin_write();
+    disconnect_locked(from, to);
     end_write();
 }
 
-void user_disconnect_dm(user_t *from, user_t *to) {
-    if (!from || !to) return;
+/* ========== Batched relationships ========== */
+
+/* Room names are stored truncated; events carry the stored form */
+static void clip_name(char *dst, const char *src) {
+    snprintf(dst, MAX_NAME, "%s", src);
+}
+
+void user_join_rooms(user_t *u, char *const *names, int n, list_result_t *results) {
+    if (!u || n <= 0) return;
 
+    char uname[MAX_NAME], room[MAX_NAME];
     begin_write();
-    from->dms = dm_list_remove(from->dms, to);
+    for (int i = 0; i < n; i++) {
+        room_t *r = room_lookup(names[i]);
+        bool created = false;
+        if (!r && !single_membership) {
+            r = room_create_locked(names[i]);
+            created = r != NULL;
+        }
+        if (!r || single_membership) {
+            results[i] = LIST_FAILED;     // arena full, or one room per user
+        } else if (join_locked(u, r)) {
+            results[i] = created ? LIST_CREATED : LIST_DONE;
+        } else {
+            results[i] = LIST_UNCHANGED;
+        }
+    }
+    strcpy(uname, u->username);
+    end_write();
+
+    for (int i = 0; i < n; i++) {
+        if (results[i] != LIST_CREATED && results[i] != LIST_DONE) continue;
+        clip_name(room, names[i]);
+        if (results[i] == LIST_CREATED) notify(LIST_ROOM_ADD, room, NULL);
+        notify(LIST_JOIN, uname, room);
+    }
+}
+
+void user_leave_rooms(user_t *u, char *const *names, int n, list_result_t *results) {
+    if (!u || n <= 0) return;
+
+    char uname[MAX_NAME], room[MAX_NAME];
+    begin_write();
+    for (int i = 0; i < n; i++) {
+        room_t *r = room_lookup(names[i]);
+        if (!r) results[i] = LIST_MISSING;
+        else results[i] = leave_locked(u, r) ? LIST_DONE : LIST_UNCHANGED;
+    }
+    strcpy(uname, u->username);
+    end_write();
+
+    for (int i = 0; i < n; i++) {
+        if (results[i] != LIST_DONE) continue;
+        clip_name(room, names[i]);
+        notify(LIST_LEAVE, uname, room);
+    }
+}
+
+void user_connect_dms(user_t *from, char *const *names, int n, list_result_t *results) {
+    if (!from || n <= 0) return;
+
+    begin_write();
+    for (int i = 0; i < n; i++) {
+        user_t *to = name_lookup(names[i]);
+        if (!to) results[i] = LIST_MISSING;
+        else if (to == from) results[i] = LIST_UNCHANGED;   // like user_connect_dm, a no-op
+        else results[i] = connect_locked(from, to) ? LIST_DONE : LIST_UNCHANGED;
+    }
+    end_write();
+}
+
+void user_disconnect_dms(user_t *from, char *const *names, int n, list_result_t *results) {
+    if (!from || n <= 0) return;
+
+    begin_write();
+    for (int i = 0; i < n; i++) {
+        user_t *to = name_lookup(names[i]);
+        if (!to) results[i] = LIST_MISSING;
+        else results[i] = disconnect_locked(from, to) ? LIST_DONE : LIST_UNCHANGED;
+    }
     end_write();
 }
 
@@ -409,6 +825,12 @@ bool users_share_room(user_t *a, user_t *b) {
     bool shared = false;
     begin_read();
 
+    if (single_membership) {
+        shared = a->room && a->room == b->room;
+        end_read();
+        return shared;
+    }
+
     room_list_t *ra = a->rooms;
     while (ra && !shared) {
         room_list_t *rb = b->rooms;
@@ -432,6 +854,12 @@ bool is_dm_peer(user_t *from, user_t *to) {
     bool found = false;
     begin_read();
 
+    if (single_membership) {
+        found = from->dm == to;
+        end_read();
+        return found;
+    }
+
     dm_list_t *dl = from->dms;
     while (dl) {
         if (dl->peer == to) {
@@ -459,34 +887,103 @@ void for_each_user(void (*cb)(user_t *u, void *ctx), void *ctx) {
     end_read();
 }
 
-/* ========== Listing functions ========== */
+void user_memberships(user_t *u,
+                      void (*room_cb)(room_t *r, void *ctx),
+                      void (*dm_cb)(user_t *peer, void *ctx),
+                      void *ctx) {
+    if (!u) return;
 
-void list_all_users(char *buffer) {
-    if (!buffer) return;
+    begin_read();
+    if (single_membership) {
+        if (u->room && room_cb) room_cb(u->room, ctx);
+        if (u->dm && dm_cb) dm_cb(u->dm, ctx);
+        end_read();
+        return;
+    }
+    for (room_list_t *rl = u->rooms; rl && room_cb; rl = rl->next) {
+        room_cb(rl->room, ctx);
+    }
+    for (dm_list_t *dl = u->dms; dl && dm_cb; dl = dl->next) {
+        dm_cb(dl->peer, ctx);
+    }
+    end_read();
+}
 
-    buffer[0] = '\0';
+void for_each_audience(user_t *sender,
+                       void (*cb)(user_t *u, bool dm, void *ctx),
+                       void *ctx) {
+    if (!sender || !cb) return;
 
     begin_read();
-    user_t *cur = users_head;
+    user_t *dm = sender->dm;
+    if (sender->room) {
+        for (user_list_t *ul = sender->room->users; ul; ul = ul->next) {
+            if (ul->user != sender) cb(ul->user, ul->user == dm, ctx);
+        }
+    }
+    if (dm && (!sender->room || dm->room != sender->room)) {
+        cb(dm, true, ctx);
+    }
+    end_read();
+}
+
+void for_each_room(void (*cb)(room_t *r, void *ctx), void *ctx) {
+    if (!cb) return;
+
+    begin_read();
+    room_t *cur = rooms_head;
     while (cur) {
-        strcat(buffer, cur->username);
-        strcat(buffer, "\n");
+        cb(cur, ctx);
         cur = cur->next;
     }
     end_read();
 }
 
-void list_all_rooms(char *buffer) {
-    if (!buffer) return;
+/* ========== Listing functions ========== */
+
+#define LIST_MORE "...\n"
+
+/*
+ * Append "name\n" at *off, keeping room for LIST_MORE and the NUL.
+ * Once a name does not fit, LIST_MORE goes in instead and false is
+ * returned.
+ */
+static bool list_append(char *buffer, size_t cap, size_t *off, const char *name) {
+    size_t n = strlen(name);
+    if (*off + n + 1 + sizeof(LIST_MORE) > cap) {
+        memcpy(buffer + *off, LIST_MORE, sizeof(LIST_MORE));
+        *off += sizeof(LIST_MORE) - 1;
+        return false;
+    }
+    memcpy(buffer + *off, name, n);
+    buffer[*off + n] = '\n';
+    *off += n + 1;
+    buffer[*off] = '\0';
+    return true;
+}
+
+void list_all_users(char *buffer, size_t cap) {
+    if (!buffer || cap < sizeof(LIST_MORE)) return;
 
     buffer[0] = '\0';
+    size_t off = 0;
 
     begin_read();
-    room_t *cur = rooms_head;
-    while (cur) {
-        strcat(buffer, cur->name);
-        strcat(buffer, "\n");
-        cur = cur->next;
+    for (user_t *cur = users_head; cur; cur = cur->next) {
+        if (!list_append(buffer, cap, &off, cur->username)) break;
+    }
+    end_read();
+}
+
+void list_all_rooms(char *buffer, size_t cap) {
+    if (!buffer || cap < sizeof(LIST_MORE)) return;
+
+    buffer[0] = '\0';
+    size_t off = 0;
+
+    begin_read();
+    for (room_t *cur = rooms_head; cur; cur = cur->next) {
+        if (!list_append(buffer, cap, &off, cur->name)) break;
     }
     end_read();
 }
@@ -505,10 +1002,10 @@ void cleanup_all(void) {
         while (ul) {
             user_list_t *tmp = ul;
             ul = ul->next;
-            free(tmp);
+            node_free(tmp);
         }
 
-        free(r);
+        arena_free(&room_arena, r);
         r = rnext;
     }
     rooms_head = NULL;
@@ -522,21 +1019,31 @@ void cleanup_all(void) {
         while (rl) {
             room_list_t *tmp = rl;
             rl = rl->next;
-            free(tmp);
+            node_free(tmp);
         }
 
         dm_list_t *dl = u->dms;
         while (dl) {
             dm_list_t *tmp = dl;
             dl = dl->next;
-            free(tmp);
+            node_free(tmp);
         }
 
+        batch_destroy(&u->batch);
+        outq_destroy(&u->out);
         close(u->socket);
-        free(u);
+        arena_free(&user_arena, u);
         u = unext;
     }
     users_head = NULL;
+    memset(name_buckets, 0, ((size_t)name_mask + 1) * sizeof(user_t *));
+
+    /* Give the recycled list nodes back to the allocator */
+    while (free_nodes) {
+        struct free_node *n = free_nodes;
+        free_nodes = n->next;
+        free(n);
+    }
 
     end_write();
 }
@@ -2,25 +2,57 @@
 #define LIST_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
+
+#include "ratelimit.h"
+#include "batch.h"
+#include "outq.h"
 
 #define MAX_NAME 30
 
+/*
+ * Users and rooms live in fixed arenas sized by list_init(). Code that
+ * keeps a reference past the list lock (shards, queued messages) holds a
+ * 32-bit handle instead of a pointer: slot index plus the slot's
+ * generation, which is bumped when the slot is freed, so a stale handle
+ * simply fails to resolve.
+ */
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1u << HANDLE_INDEX_BITS) - 1)
+#define MAX_ARENA_SLOTS   HANDLE_INDEX_MASK     // slot 0 is never used
+#define HANDLE_NONE       0
+
+typedef uint32_t handle_t;
+
 /* Forward declarations */
 typedef struct user user_t;
 typedef struct room room_t;
 typedef struct user_list user_list_t;
 typedef struct room_list room_list_t;
 typedef struct dm_list dm_list_t;
+struct stream;
 
 /* -------------------- USER STRUCT -------------------- */
 
 struct user {
-    int socket;                 // socket descriptor
+    int socket;                 // socket descriptor (-1 for remote users)
+    uint32_t node;              // 0 = local, else federated node that owns the user
     char username[MAX_NAME];    // username
     room_list_t *rooms;         // rooms this user is in
     dm_list_t *dms;             // users this user has DM connections TO (one-way)
+    room_t *room;               // single-membership mode: the one room (rooms unused)
+    user_t *dm;                 // single-membership mode: the one DM target (dms unused)
+    token_bucket_t chat_bucket; // rate limit for chat lines
+    token_bucket_t cmd_bucket;  // rate limit for create/join/login
+    batch_buf_t batch;          // chat lines waiting on a batched room's window
+    outq_t out;                 // everything sent to this user, by priority class
+    wheel_timer_t idle;         // keepalive check (local users, when enabled)
+    _Atomic uint64_t last_active_ns; // last input from the client
+    struct stream *stream;      // paste being read from this user (its reader only)
     user_t *next;               // next user in global user list
+    user_t *name_next;          // next user in the same name-index bucket
 };
 
 /* -------------------- ROOM STRUCT -------------------- */
@@ -28,6 +60,7 @@ struct user {
 struct room {
     char name[MAX_NAME];        // room name
     user_list_t *users;         // users in this room
+    atomic_int batch_ms;        // batching window for room chat (0 = off); shards read it unlocked
     room_t *next;               // next room in global room list
 };
 
@@ -53,19 +86,74 @@ struct dm_list {
 extern user_t *users_head;
 extern room_t *rooms_head;
 
+/*
+ * Single-membership mode (-s): a user is in at most one room and has at
+ * most one DM target. Joining a room leaves the previous one and
+ * connecting replaces the previous DM. Set once before any users exist.
+ */
+extern bool single_membership;
+
+/* ================== CHANGE EVENTS ===================== */
+
+/* What changed; a and b are the names involved (see list_set_observer) */
+typedef enum {
+    LIST_USER_ADD,      // a = user
+    LIST_USER_DEL,      // a = user
+    LIST_USER_RENAME,   // a = old name, b = new name
+    LIST_ROOM_ADD,      // a = room
+    LIST_JOIN,          // a = user, b = room
+    LIST_LEAVE,         // a = user, b = room
+} list_event_t;
+
+/*
+ * Install the single observer called for every successful mutation.
+ * It runs on the mutating thread after the lock has been dropped, so it
+ * may call back into list.c. Set once at startup.
+ */
+void list_set_observer(void (*cb)(list_event_t ev, const char *a, const char *b));
+
 /* ================== FUNCTION PROTOTYPES =============== */
 
-/* User operations */
+/* Allocate the user and room arenas; call once before anything else */
+int     list_init(uint32_t max_users, uint32_t max_rooms);
+
+/* Handles (see above); *_get returns NULL for stale or bad handles */
+handle_t user_handle(const user_t *u);
+user_t  *user_get(handle_t h);
+handle_t room_handle(const room_t *r);
+room_t  *room_get(handle_t h);
+
+/* User operations (create_user returns NULL when the arena is full) */
 user_t *create_user(int socket, const char *username);
-user_t *find_user_by_name(const char *username);
+user_t *find_user_by_name(const char *username);   // hashed, O(1)
+user_t *find_user_by_name_node(const char *username, uint32_t node);
 user_t *find_user_by_socket(int socket);
 void    user_rename(user_t *u, const char *newname);
 void    remove_user(user_t *u);
 
+/*
+ * Look up a user by name and run cb on it under the read lock, so it
+ * cannot be removed while cb uses it. Returns false if nobody has that
+ * name (cb is not called).
+ */
+bool    with_user_by_name(const char *username, void (*cb)(user_t *u, void *ctx), void *ctx);
+
+/*
+ * Resolve n handles under one read lock and run cb on each user that
+ * still exists; i is the handle's index in hs. Stale handles are skipped.
+ */
+void    with_users(const handle_t *hs, int n, void (*cb)(user_t *u, int i, void *ctx), void *ctx);
+
 /* Room operations */
 room_t *create_room(const char *room_name);
 room_t *find_room(const char *room_name);
 void    delete_room(room_t *room);   // not strictly required
+void    room_set_batch(room_t *r, int window_ms);
+
+/* Batching window; safe without the list lock (rooms live in an arena) */
+static inline int room_batch_ms(room_t *r) {
+    return atomic_load_explicit(&r->batch_ms, memory_order_relaxed);
+}
 
 /* Relationships: rooms */
 void user_join_room(user_t *u, room_t *r);
@@ -75,6 +163,28 @@ void user_leave_room(user_t *u, room_t *r);
 void user_connect_dm(user_t *from, user_t *to);      // from → to
 void user_disconnect_dm(user_t *from, user_t *to);   // remove from->to link
 
+/*
+ * Batched relationships: apply a whole list of room or user names under
+ * one write-lock acquisition (change events follow after the lock is
+ * dropped). results[i] is the outcome for names[i]. Joining creates
+ * missing rooms; it is not available in single-membership mode, where a
+ * user has one room (every entry is LIST_FAILED).
+ */
+#define LIST_BATCH_MAX 64           // names per batch call
+
+typedef enum {
+    LIST_DONE = 0,      // joined / left / connected
+    LIST_CREATED,       // joined a room that had to be created
+    LIST_UNCHANGED,     // already (or, for leave, never) a member
+    LIST_MISSING,       // no such room or user
+    LIST_FAILED,        // arena full, or not allowed in this mode
+} list_result_t;
+
+void user_join_rooms(user_t *u, char *const *names, int n, list_result_t *results);
+void user_leave_rooms(user_t *u, char *const *names, int n, list_result_t *results);
+void user_connect_dms(user_t *from, char *const *names, int n, list_result_t *results);
+void user_disconnect_dms(user_t *from, char *const *names, int n, list_result_t *results);
+
 /* Helpers for messaging logic (optional outside usage) */
 bool users_share_room(user_t *a, user_t *b);
 bool is_dm_peer(user_t *from, user_t *to);
@@ -82,9 +192,34 @@ bool is_dm_peer(user_t *from, user_t *to);
 /* Iterate over all users with proper read-locking */
 void for_each_user(void (*cb)(user_t *u, void *ctx), void *ctx);
 
-/* Listing (results written into buffer as text) */
-void list_all_users(char *buffer);
-void list_all_rooms(char *buffer);
+/* Visit one user's rooms and DM targets under a single read lock */
+void user_memberships(user_t *u,
+                      void (*room_cb)(room_t *r, void *ctx),
+                      void (*dm_cb)(user_t *peer, void *ctx),
+                      void *ctx);
+
+/*
+ * Single-membership fan-out: visit everyone in sender's room, then its
+ * DM target if that is not already one of them, under one read lock.
+ * dm is true for the DM target. No global scan.
+ */
+void for_each_audience(user_t *sender,
+                       void (*cb)(user_t *u, bool dm, void *ctx),
+                       void *ctx);
+
+/* Users (proxies included) and rooms that exist; no lock taken */
+unsigned long list_user_count(void);
+unsigned long list_room_count(void);
+
+/* Iterate over all rooms with proper read-locking */
+void for_each_room(void (*cb)(room_t *r, void *ctx), void *ctx);
+
+/*
+ * Listing: one name per line into buffer, at most cap bytes with the
+ * NUL. A list that does not fit is cut short with a "..." line.
+ */
+void list_all_users(char *buffer, size_t cap);
+void list_all_rooms(char *buffer, size_t cap);
 
 /* Cleanup everything (for Ctrl-C) */
 void cleanup_all(void);
@@ -0,0 +1,581 @@
+/*
+ * loadgen - load generator and end-to-end latency benchmark for the chat server.
+ *
+ * Opens many client connections from one process with epoll, logs them in,
+ * spreads them over rooms and DM links, then drives chat traffic at a fixed
+ * rate. Every chat line carries its send time ("T<ns>"), so receivers can
+ * measure send-to-receive latency (CLOCK_MONOTONIC is shared on one box).
+ *
+ * With -j <file> it replays a recorded workload instead: one JSON object
+ * per line with "conn" (connection index), "delay_ms" (pause before the
+ * line) and "line" (the text to send). Objects without "line" use "body"
+ * as chat text, so any JSONL file such as requests.jsonl can be replayed.
+ *
+ * Run the server with -r 0 so its chat rate limit doesn't shape the load.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "clock.h"
+#include "hist.h"
+#include "command.h"
+
+#define RBUF        16384
+#define MAX_EVENTS  1024
+#define PROMPT      "chat>"
+#define MAX_PENDING 4           // handshakes in flight (the server's listen backlog is tiny)
+
+/* Setup runs in two phases with a barrier between them: DM links need every user logged in */
+enum { ST_CONNECTING, ST_SETUP, ST_LOGGED, ST_LINKING, ST_READY, ST_CLOSED };
+
+struct lconn {
+    int      fd;
+    int      id;
+    int      state;
+    int      step;          // setup step
+    int      awaiting;      // command replies still expected
+    uint64_t cmd_sent_ns;   // when the oldest awaited command was sent
+    size_t   rlen;
+    char     rbuf[RBUF];
+};
+
+/* A line of a replayed workload */
+struct replay_line {
+    int   conn;
+    int   delay_ms;
+    char *text;
+};
+
+static struct {
+    const char *host;
+    int         port;
+    int         nconns;
+    int         nrooms;
+    int         ndms;
+    double      rate;           // chat lines per second, all connections together
+    int         duration;       // seconds of traffic
+    int         msg_size;       // bytes of padding after the timestamp
+    const char *replay;
+} opt = { "127.0.0.1", 8888, 100, 10, 0, 1000, 10, 0, NULL };
+
+static struct lconn *conns;
+static int epfd;
+static int nready = 0;
+static int nlogged = 0;             // waiting at the barrier
+static int nclosed = 0;
+static int nopened = 0;
+static int npending = 0;            // opened, MOTD not seen yet
+static struct sockaddr_in server_addr;
+
+static histogram_t latency;         // send -> receive of chat lines
+static histogram_t cmd_latency;     // command -> reply prompt
+static unsigned long sent = 0, received = 0, send_failed = 0;
+static unsigned long setup_failed = 0;  // setup commands the server refused
+
+/* Same classification as the server, from its own command table */
+static int is_command(const char *line) {
+    size_t n;
+    const char *word = cmd_first_word(line, &n);
+    return cmd_lookup(word, n) != CMD_CHAT;
+}
+
+/* ========== Sending ========== */
+
+static int send_line(struct lconn *c, const char *line) {
+    size_t len = strlen(line);
+    ssize_t n = send(c->fd, line, len, MSG_NOSIGNAL);
+    if (n != (ssize_t)len) {
+        send_failed++;
+        return -1;
+    }
+    return 0;
+}
+
+static void send_command(struct lconn *c, const char *line) {
+    if (c->awaiting++ == 0) c->cmd_sent_ns = now_ns();
+    send_line(c, line);
+}
+
+static void send_chat(struct lconn *c, const char *text) {
+    char line[4096];
+    int n = snprintf(line, sizeof(line), "T%lu %s", (unsigned long)now_ns(), text ? text : "");
+
+    for (int i = 0; i < opt.msg_size && n < (int)sizeof(line) - 2; i++) {
+        line[n++] = 'x';
+    }
+    if (n > 0 && line[n - 1] != '\n') line[n++] = '\n';
+    line[n] = '\0';
+
+    if (send_line(c, line) == 0) sent++;
+}
+
+/* ========== Setup: login, rooms, DM links ========== */
+
+/* Issue the next command of the current phase; returns 0 once it is done */
+static int setup_next(struct lconn *c) {
+    char line[128];
+
+    if (c->state == ST_SETUP) {
+        switch (c->step++) {
+        case 0:
+            snprintf(line, sizeof(line), "login lg%d\n", c->id);
+            break;
+        case 1:
+            snprintf(line, sizeof(line), "leave Lobby\n");
+            break;
+        case 2:
+            snprintf(line, sizeof(line), "join lgroom%d\n", c->id % opt.nrooms);
+            break;
+        default:
+            return 0;
+        }
+    } else {
+        int dm = c->step++ - 3;
+        if (opt.replay || dm >= opt.ndms) return 0;
+        snprintf(line, sizeof(line), "connect lg%d\n", (c->id + 1 + dm * 7) % opt.nconns);
+    }
+    send_command(c, line);
+    return 1;
+}
+
+/* Next setup command, or on to the barrier (login phase) or ready (links) */
+static void setup_advance(struct lconn *c) {
+    if (setup_next(c)) return;
+    if (c->state == ST_SETUP) {
+        c->state = ST_LOGGED;
+        nlogged++;
+    } else {
+        c->state = ST_READY;
+        nready++;
+    }
+}
+
+/* Setup replies that mean the command did not take effect */
+static int setup_refused(const char *seg) {
+    return strstr(seg, "not found") || strstr(seg, "does not exist") ||
+           strstr(seg, "Error") || strstr(seg, "Rate limit") || strstr(seg, "Usage");
+}
+
+/* ========== Receiving ========== */
+
+/* One reply segment ending in a prompt: a chat delivery or a command reply */
+static void handle_segment(struct lconn *c, char *seg, uint64_t now) {
+    int deliveries = 0;
+
+    for (char *p = strstr(seg, "\n::"); p; p = strstr(p + 3, "\n::")) {
+        deliveries++;
+        char *t = strstr(p, "> T");
+        char *eol = strchr(p + 1, '\n');
+        if (t && (!eol || t < eol)) {
+            uint64_t ts = strtoull(t + 3, NULL, 10);
+            if (ts && ts <= now) hist_record(&latency, now - ts);
+            received++;
+        }
+    }
+
+    if (deliveries == 0 && c->awaiting > 0) {
+        int setup = c->state == ST_SETUP || c->state == ST_LINKING;
+        if (c->state == ST_SETUP && c->step == 0) npending--;   // MOTD
+        else if (setup && setup_refused(seg)) setup_failed++;
+        hist_record(&cmd_latency, now - c->cmd_sent_ns);
+        c->cmd_sent_ns = now;
+        c->awaiting--;
+
+        if (setup && c->awaiting == 0) setup_advance(c);
+    }
+}
+
+static void close_conn(struct lconn *c) {
+    if (c->state == ST_CLOSED) return;
+    if (c->state == ST_READY) nready--;
+    if (c->state == ST_LOGGED) nlogged--;
+    if (c->state == ST_CONNECTING || (c->state == ST_SETUP && c->step == 0)) npending--;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = ST_CLOSED;
+    nclosed++;
+}
+
+static void handle_readable(struct lconn *c) {
+    while (1) {
+        if (c->rlen == RBUF - 1) c->rlen = 0;     // garbage; resync
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, RBUF - 1 - c->rlen);
+        if (n == 0) {
+            close_conn(c);
+            return;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_conn(c);
+            return;
+        }
+        c->rlen += n;
+        c->rbuf[c->rlen] = '\0';
+
+        /* Process every complete segment (text up to and including a prompt) */
+        uint64_t now = now_ns();
+        char *start = c->rbuf;
+        char *end;
+        while ((end = strstr(start, PROMPT)) != NULL) {
+            *end = '\0';
+            handle_segment(c, start, now);
+            start = end + strlen(PROMPT);
+        }
+        c->rlen -= start - c->rbuf;
+        memmove(c->rbuf, start, c->rlen);
+    }
+}
+
+static void handle_event(struct lconn *c, uint32_t events) {
+    if (c->state == ST_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & (EPOLLERR | EPOLLHUP))) {
+            close_conn(c);
+            return;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->state = ST_SETUP;
+        c->awaiting = 1;            // the MOTD
+        c->cmd_sent_ns = now_ns();
+        return;
+    }
+
+    if (events & EPOLLIN) handle_readable(c);
+    else if (events & (EPOLLERR | EPOLLHUP)) close_conn(c);
+}
+
+static void poll_once(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        handle_event(events[i].data.ptr, events[i].events);
+    }
+}
+
+/* ========== Connecting ========== */
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int resolve_server(void) {
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host, &server_addr.sin_addr) != 1) {
+        struct hostent *he = gethostbyname(opt.host);
+        if (!he) return -1;
+        memcpy(&server_addr.sin_addr, he->h_addr_list[0], sizeof(server_addr.sin_addr));
+    }
+
+    conns = calloc(opt.nconns, sizeof(struct lconn));
+    return conns ? 0 : -1;
+}
+
+/*
+ * Start more connections, keeping at most MAX_PENDING handshakes in
+ * flight. Overflowing the server's accept queue would strand clients
+ * until SYN-ACK retransmits (seconds), which would skew every number.
+ */
+static void open_more(void) {
+    while (npending < MAX_PENDING && nopened < opt.nconns) {
+        struct lconn *c = &conns[nopened];
+        c->id = nopened++;
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c->fd < 0) {
+            perror("socket");
+            c->state = ST_CLOSED;
+            nclosed++;
+            continue;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 &&
+            errno != EINPROGRESS) {
+            perror("connect");
+            close(c->fd);
+            c->state = ST_CLOSED;
+            nclosed++;
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        npending++;
+    }
+}
+
+/* Wait until every live connection has finished both setup phases */
+static int wait_ready(int timeout_s) {
+    uint64_t deadline = now_ns() + (uint64_t)timeout_s * 1000000000ull;
+    while (nlogged + nclosed < opt.nconns && now_ns() < deadline) {
+        open_more();
+        poll_once(1);
+    }
+
+    /* Barrier passed: every user that will exist does, so link DMs now */
+    for (int i = 0; i < nopened; i++) {
+        struct lconn *c = &conns[i];
+        if (c->state != ST_LOGGED) continue;
+        nlogged--;
+        c->state = ST_LINKING;
+        setup_advance(c);
+    }
+    while (nready + nclosed < opt.nconns && now_ns() < deadline) {
+        poll_once(1);
+    }
+    return nready;
+}
+
+/* ========== Replay ========== */
+
+/* Extract a JSON string value for key into out (handles common escapes) */
+static int json_string(const char *obj, const char *key, char *out, size_t outlen) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\"", key);
+    const char *p = strstr(obj, pat);
+    if (!p) return -1;
+    p = strchr(p + strlen(pat), ':');
+    if (!p) return -1;
+    while (*++p == ' ') { }
+    if (*p != '"') return -1;
+    p++;
+
+    size_t n = 0;
+    while (*p && *p != '"' && n + 1 < outlen) {
+        char ch = *p++;
+        if (ch == '\\' && *p) {
+            ch = *p++;
+            switch (ch) {
+            case 'n': ch = '\n'; break;
+            case 't': ch = '\t'; break;
+            case 'r': ch = '\r'; break;
+            case 'u': ch = '?'; p += (strlen(p) >= 4) ? 4 : strlen(p); break;
+            default: break;             // \" \\ \/
+            }
+        }
+        out[n++] = ch;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+static int json_int(const char *obj, const char *key, int def) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\"", key);
+    const char *p = strstr(obj, pat);
+    if (!p || !(p = strchr(p + strlen(pat), ':'))) return def;
+    return atoi(p + 1);
+}
+
+static struct replay_line *load_replay(const char *path, int *count, int *max_conn) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+
+    struct replay_line *lines = NULL;
+    int n = 0, cap = 0;
+    char *obj = NULL;
+    size_t objcap = 0;
+    *max_conn = 0;
+
+    while (getline(&obj, &objcap, f) > 0) {
+        char *text = malloc(objcap + 1);
+        if (!text) break;
+        if (json_string(obj, "line", text, objcap + 1) < 0 &&
+            json_string(obj, "body", text, objcap + 1) < 0) {
+            free(text);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            lines = realloc(lines, cap * sizeof(*lines));
+        }
+        lines[n].conn = json_int(obj, "conn", n);
+        lines[n].delay_ms = json_int(obj, "delay_ms", 0);
+        lines[n].text = text;
+        if (lines[n].conn > *max_conn) *max_conn = lines[n].conn;
+        n++;
+    }
+
+    free(obj);
+    fclose(f);
+    *count = n;
+    return lines;
+}
+
+static void run_replay(struct replay_line *lines, int n) {
+    for (int i = 0; i < n; i++) {
+        uint64_t until = now_ns() + (uint64_t)lines[i].delay_ms * 1000000ull;
+        do {
+            poll_once(lines[i].delay_ms ? 1 : 0);
+        } while (now_ns() < until);
+
+        struct lconn *c = &conns[lines[i].conn % opt.nconns];
+        if (c->state != ST_READY) continue;
+
+        /* One logical line per send; the server treats each read as a line */
+        char *text = lines[i].text;
+        text[strcspn(text, "\n")] = '\0';
+
+        if (is_command(text)) {
+            char line[4096];
+            snprintf(line, sizeof(line), "%s\n", text);
+            send_command(c, line);
+        } else {
+            send_chat(c, text);
+        }
+        poll_once(1);
+    }
+}
+
+/* ========== Steady-state traffic ========== */
+
+static void run_traffic(void) {
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)opt.duration * 1000000000ull;
+    uint64_t next_report = start + 1000000000ull;
+    unsigned long last_sent = 0, last_recv = 0;
+    int cursor = 0;
+
+    while (now_ns() < end && nready > 0) {
+        poll_once(1);
+
+        /* Send whatever the schedule says is due by now */
+        uint64_t now = now_ns();
+        unsigned long due = (unsigned long)((now - start) / 1e9 * opt.rate);
+        while (sent + send_failed < due) {
+            struct lconn *c = &conns[cursor];
+            cursor = (cursor + 1) % opt.nconns;
+            if (c->state == ST_READY) send_chat(c, NULL);
+            else if (nready == 0) break;
+        }
+
+        if (now >= next_report) {
+            printf("t=%2lus sent/s=%lu recv/s=%lu conns=%d p99=%.1fus\n",
+                   (unsigned long)((now - start) / 1000000000ull),
+                   sent - last_sent, received - last_recv, nready,
+                   hist_percentile(&latency, 0.99) / 1000.0);
+            last_sent = sent;
+            last_recv = received;
+            next_report += 1000000000ull;
+        }
+    }
+}
+
+/* ========== Main ========== */
+
+static void report(double seconds) {
+    printf("\n--- loadgen results ---\n");
+    printf("connections: %d ready, %d failed\n", nready, nclosed);
+    printf("chat sent: %lu (%.0f/s), send failures: %lu\n", sent, sent / seconds, send_failed);
+    printf("chat received: %lu (%.0f/s)\n", received, received / seconds);
+    printf("send->receive latency (us): p50=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+           hist_percentile(&latency, 0.50) / 1000.0,
+           hist_percentile(&latency, 0.99) / 1000.0,
+           hist_percentile(&latency, 0.999) / 1000.0,
+           atomic_load(&latency.max) / 1000.0);
+    printf("command reply latency (us): p50=%.1f p99=%.1f p999=%.1f (n=%lu)\n",
+           hist_percentile(&cmd_latency, 0.50) / 1000.0,
+           hist_percentile(&cmd_latency, 0.99) / 1000.0,
+           hist_percentile(&cmd_latency, 0.999) / 1000.0,
+           atomic_load(&cmd_latency.count));
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H <host>   server address (default 127.0.0.1)\n"
+        "  -p <port>   server port (default 8888)\n"
+        "  -c <n>      connections (default 100)\n"
+        "  -r <n>      rooms to spread connections over (default 10)\n"
+        "  -d <n>      DM links per connection (default 0)\n"
+        "  -m <rate>   chat lines per second, total (default 1000)\n"
+        "  -t <sec>    traffic duration (default 10)\n"
+        "  -s <bytes>  padding per chat line (default 0)\n"
+        "  -j <file>   replay a JSONL workload instead of steady traffic\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    int o;
+    while ((o = getopt(argc, argv, "H:p:c:r:d:m:t:s:j:h")) != -1) {
+        switch (o) {
+        case 'H': opt.host = optarg; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 'c': opt.nconns = atoi(optarg); break;
+        case 'r': opt.nrooms = atoi(optarg); break;
+        case 'd': opt.ndms = atoi(optarg); break;
+        case 'm': opt.rate = atof(optarg); break;
+        case 't': opt.duration = atoi(optarg); break;
+        case 's': opt.msg_size = atoi(optarg); break;
+        case 'j': opt.replay = optarg; break;
+        default:
+            usage(argv[0]);
+            exit(o == 'h' ? 0 : 1);
+        }
+    }
+
+    struct replay_line *lines = NULL;
+    int nlines = 0;
+    if (opt.replay) {
+        int max_conn;
+        lines = load_replay(opt.replay, &nlines, &max_conn);
+        if (!lines) {
+            fprintf(stderr, "Cannot read workload %s\n", opt.replay);
+            exit(1);
+        }
+        if (max_conn + 1 < opt.nconns) opt.nconns = max_conn + 1;
+    }
+    if (opt.nconns < 1 || opt.nrooms < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    epfd = epoll_create1(0);
+    if (epfd < 0 || resolve_server() < 0) {
+        fprintf(stderr, "Error opening connections\n");
+        exit(1);
+    }
+
+    uint64_t t0 = now_ns();
+    int ready = wait_ready(60);
+    printf("%d/%d connections ready in %.2fs\n", ready, opt.nconns, (now_ns() - t0) / 1e9);
+    if (setup_failed) {
+        printf("warning: %lu setup commands were refused (server rate limits? try -R 0)\n",
+               setup_failed);
+    }
+
+    t0 = now_ns();
+    if (opt.replay) {
+        run_replay(lines, nlines);
+        uint64_t drain = now_ns() + 500000000ull;      // let the last deliveries land
+        while (now_ns() < drain) poll_once(10);
+    } else {
+        run_traffic();
+    }
+    report((now_ns() - t0) / 1e9);
+
+    for (int i = 0; i < nopened; i++) close_conn(&conns[i]);
+    return 0;
+}
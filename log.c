@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "log.h"
+
+#define LOG_BATCH    1024           // records collected per write pass
+#define LOG_OUT_MAX  65536          // bytes buffered per stream before a write()
+#define LOG_LINE_MAX (LOG_MSG_MAX + 64)
+
+struct log_record {
+    uint64_t    ts_ns;              // wall clock, for the timestamp and ordering
+    int         tid;
+    uint8_t     level;
+    uint16_t    len;                // bytes used in args
+    const char *fmt;                // NULL: args holds the finished text
+    char        args[LOG_MSG_MAX];  // arguments packed in format order
+};
+
+/*
+ * One ring per logging thread: the owner is the only producer and the
+ * writer the only consumer. When the owner exits the ring is released
+ * and the next new thread takes it over, so thread-per-client mode does
+ * not leak a ring per connection.
+ */
+struct log_ring {
+    _Atomic unsigned long head;     // next record to write out (writer)
+    _Atomic unsigned long tail;     // next free slot (owner)
+    atomic_bool       owned;
+    struct log_ring  *next;         // registry of all rings
+    struct log_record recs[LOG_RING_SIZE];
+};
+
+atomic_int log_level = LL_INFO;
+
+static atomic_ulong dropped;
+static atomic_bool running;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = NULL;
+static __thread struct log_ring *my_ring = NULL;
+static __thread int my_tid = 0;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping = false;
+
+static const char *level_names[LL_NLEVELS] = { "debug", "info", "warn", "error" };
+static const char *level_tags[LL_NLEVELS]  = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+/* ========== Levels ========== */
+
+void log_set_level(log_level_t lvl) {
+    if (lvl >= LL_NLEVELS) lvl = LL_ERROR;
+    atomic_store(&log_level, lvl);
+}
+
+int log_level_parse(const char *name) {
+    for (int l = 0; l < LL_NLEVELS; l++) {
+        if (strcmp(name, level_names[l]) == 0) return l;
+    }
+    return -1;
+}
+
+const char *log_level_name(log_level_t lvl) {
+    return lvl < LL_NLEVELS ? level_names[lvl] : "unknown";
+}
+
+unsigned long log_dropped(void) {
+    return atomic_load(&dropped);
+}
+
+/* ========== Per-thread rings ========== */
+
+static void ring_release(void *p) {
+    struct log_ring *r = p;
+    atomic_store_explicit(&r->owned, false, memory_order_release);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/* First record on a thread takes a released ring or registers a new one */
+static struct log_ring *ring_get(void) {
+    if (my_ring) return my_ring;
+    pthread_once(&key_once, make_key);
+
+    pthread_mutex_lock(&registry_lock);
+    struct log_ring *r;
+    for (r = rings; r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->owned, &expected, true)) break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (r) {
+            atomic_init(&r->owned, true);
+            r->next = rings;
+            rings = r;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if (!r) return NULL;
+
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+/* ========== Argument capture ========== */
+
+/*
+ * Producers store each argument as its promoted type, strings inline
+ * with their NUL; the writer walks the same format and prints them one
+ * conversion at a time.
+ */
+enum arg_kind { A_NONE, A_INT, A_LONG, A_LLONG, A_SIZE, A_DOUBLE, A_LDOUBLE, A_PTR, A_STR, A_PCT };
+
+/* Parse the conversion after a '%'; returns the end of it */
+static const char *parse_spec(const char *p, int *kind, int *stars) {
+    int len = 0;        // 1 l, 2 ll/j, 3 z/t, 4 L
+    *stars = 0;
+    while (*p && strchr("-+ #0", *p)) p++;
+    if (*p == '*') { (*stars)++; p++; }
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') { (*stars)++; p++; }
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    for (;; p++) {
+        if (*p == 'h') continue;
+        else if (*p == 'l') len = (len == 1) ? 2 : 1;
+        else if (*p == 'j') len = 2;
+        else if (*p == 'z' || *p == 't') len = 3;
+        else if (*p == 'L') len = 4;
+        else break;
+    }
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        *kind = len == 1 ? A_LONG : len == 2 ? A_LLONG : len == 3 ? A_SIZE : A_INT;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        *kind = len == 4 ? A_LDOUBLE : A_DOUBLE;
+        break;
+    case 's': *kind = A_STR; break;
+    case 'p': *kind = A_PTR; break;
+    case '%': *kind = A_PCT; break;
+    default:  *kind = A_NONE; return p;     // not a conversion we know: printed as is
+    }
+    return p + 1;
+}
+
+#define PUT(T, v) do { T v_ = (v); \
+        if (off + sizeof(T) > LOG_MSG_MAX) goto full; \
+        memcpy(rec->args + off, &v_, sizeof(T)); off += sizeof(T); } while (0)
+
+/* Copy fmt's arguments into rec; stops at the first one that does not fit */
+static void pack_args(struct log_record *rec, const char *fmt, va_list ap) {
+    size_t off = 0;
+    for (const char *p = fmt; *p; ) {
+        if (*p++ != '%') continue;
+        int kind, stars;
+        p = parse_spec(p, &kind, &stars);
+        for (int i = 0; i < stars; i++) PUT(int, va_arg(ap, int));
+        switch (kind) {
+        case A_INT:     PUT(int, va_arg(ap, int)); break;
+        case A_LONG:    PUT(long, va_arg(ap, long)); break;
+        case A_LLONG:   PUT(long long, va_arg(ap, long long)); break;
+        case A_SIZE:    PUT(size_t, va_arg(ap, size_t)); break;
+        case A_DOUBLE:  PUT(double, va_arg(ap, double)); break;
+        case A_LDOUBLE: PUT(long double, va_arg(ap, long double)); break;
+        case A_PTR:     PUT(void *, va_arg(ap, void *)); break;
+        case A_STR: {
+            const char *s = va_arg(ap, const char *);
+            if (!s) s = "(null)";
+            size_t n = strlen(s);
+            if (off + 1 >= LOG_MSG_MAX) goto full;
+            if (n > LOG_MSG_MAX - off - 1) n = LOG_MSG_MAX - off - 1;   // cut long strings short
+            memcpy(rec->args + off, s, n);
+            rec->args[off + n] = '\0';
+            off += n + 1;
+            break;
+        }
+        default: break;
+        }
+    }
+full:
+    rec->len = (uint16_t)off;
+}
+
+#undef PUT
+
+#define TAKE(T, v) do { if (in + sizeof(T) > end) goto done; \
+        memcpy(&(v), in, sizeof(T)); in += sizeof(T); } while (0)
+
+#define EMIT(v) (stars == 0 ? snprintf(o, room, spec, v) : \
+                 stars == 1 ? snprintf(o, room, spec, st[0], v) : \
+                              snprintf(o, room, spec, st[0], st[1], v))
+
+/* Format rec's message into out (writer side) */
+static void render(const struct log_record *rec, char *out, size_t cap) {
+    if (!rec->fmt) {
+        snprintf(out, cap, "%s", rec->args);
+        return;
+    }
+
+    const char *in = rec->args, *end = rec->args + rec->len;
+    char *o = out;
+    size_t room = cap;
+    for (const char *p = rec->fmt; *p && room > 1; ) {
+        if (*p != '%') {
+            *o++ = *p++;
+            room--;
+            continue;
+        }
+        const char *start = p;
+        int kind, stars, k = 0;
+        p = parse_spec(p + 1, &kind, &stars);
+
+        char spec[32];
+        size_t slen = (size_t)(p - start);
+        if (kind == A_NONE || slen >= sizeof(spec)) {
+            k = snprintf(o, room, "%.*s", (int)slen, start);
+        } else {
+            memcpy(spec, start, slen);
+            spec[slen] = '\0';
+            int st[2] = { 0, 0 };
+            for (int i = 0; i < stars; i++) TAKE(int, st[i]);
+
+            switch (kind) {
+            case A_INT:     { int v;         TAKE(int, v);         k = EMIT(v); break; }
+            case A_LONG:    { long v;        TAKE(long, v);        k = EMIT(v); break; }
+            case A_LLONG:   { long long v;   TAKE(long long, v);   k = EMIT(v); break; }
+            case A_SIZE:    { size_t v;      TAKE(size_t, v);      k = EMIT(v); break; }
+            case A_DOUBLE:  { double v;      TAKE(double, v);      k = EMIT(v); break; }
+            case A_LDOUBLE: { long double v; TAKE(long double, v); k = EMIT(v); break; }
+            case A_PTR:     { void *v;       TAKE(void *, v);      k = EMIT(v); break; }
+            case A_STR: {
+                if (in >= end) goto done;
+                const char *v = in;
+                in += strlen(in) + 1;
+                k = EMIT(v);
+                break;
+            }
+            case A_PCT: k = snprintf(o, room, "%%"); break;
+            }
+        }
+        if (k < 0) k = 0;
+        if ((size_t)k >= room) k = (int)room - 1;
+        o += k;
+        room -= k;
+    }
+done:
+    *o = '\0';
+}
+
+#undef TAKE
+#undef EMIT
+
+/* ========== Formatting and output ========== */
+
+static size_t format_record(const struct log_record *rec, char *out, size_t cap) {
+    char msg[LOG_MSG_MAX];
+    render(rec, msg, sizeof(msg));
+    size_t m = strlen(msg);
+    while (m > 0 && msg[m - 1] == '\n') msg[--m] = '\0';   // one record, one line
+
+    time_t sec = (time_t)(rec->ts_ns / 1000000000ull);
+    unsigned long usec = (unsigned long)(rec->ts_ns % 1000000000ull) / 1000;
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+
+    int n = snprintf(out, cap, "%04d-%02d-%02dT%02d:%02d:%02d.%06luZ %s [%d] %s\n",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                     tm.tm_hour, tm.tm_min, tm.tm_sec, usec,
+                     level_tags[rec->level], rec->tid, msg);
+    if (n < 0) return 0;
+    return (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+static void write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;     // nowhere left to report it
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static inline int record_fd(const struct log_record *rec) {
+    return rec->level >= LL_WARN ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+/* ========== Writer thread ========== */
+
+/* Only the writer (or log_stop after joining it) touches these */
+static struct log_record batch[LOG_BATCH];
+static char outbuf[2][LOG_OUT_MAX];
+static size_t outlen[2];
+static unsigned long dropped_reported;
+
+static void out_flush(int i) {
+    write_all(i ? STDERR_FILENO : STDOUT_FILENO, outbuf[i], outlen[i]);
+    outlen[i] = 0;
+}
+
+static void out_append(const struct log_record *rec) {
+    int i = record_fd(rec) == STDERR_FILENO;
+    if (outlen[i] + LOG_LINE_MAX > LOG_OUT_MAX) out_flush(i);
+    outlen[i] += format_record(rec, outbuf[i] + outlen[i], LOG_LINE_MAX);
+}
+
+static size_t collect(void) {
+    size_t n = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (struct log_ring *r = rings; r && n < LOG_BATCH; r = r->next) {
+        unsigned long h = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned long t = atomic_load_explicit(&r->tail, memory_order_acquire);
+        while (h != t && n < LOG_BATCH) {
+            batch[n++] = r->recs[h & (LOG_RING_SIZE - 1)];
+            h++;
+        }
+        atomic_store_explicit(&r->head, h, memory_order_release);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return n;
+}
+
+static int by_time(const void *a, const void *b) {
+    const struct log_record *x = a, *y = b;
+    return (x->ts_ns > y->ts_ns) - (x->ts_ns < y->ts_ns);
+}
+
+/* Write out everything queued, oldest first within each pass */
+static void drain(void) {
+    size_t n;
+    do {
+        n = collect();
+        qsort(batch, n, sizeof(batch[0]), by_time);
+        for (size_t i = 0; i < n; i++) out_append(&batch[i]);
+    } while (n == LOG_BATCH);
+
+    unsigned long d = atomic_load(&dropped);
+    if (d != dropped_reported) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        struct log_record rec = {
+            .ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec,
+            .level = LL_WARN,
+        };
+        snprintf(rec.args, sizeof(rec.args), "log: %lu records dropped (rings full)",
+                 d - dropped_reported);
+        out_append(&rec);
+        dropped_reported = d;
+    }
+
+    if (outlen[0]) out_flush(0);
+    if (outlen[1]) out_flush(1);
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wake_lock);
+    while (!stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wake_cond, &wake_lock, &ts);
+
+        pthread_mutex_unlock(&wake_lock);
+        drain();
+        pthread_mutex_lock(&wake_lock);
+    }
+    pthread_mutex_unlock(&wake_lock);
+    return NULL;
+}
+
+int log_start(void) {
+    if (atomic_load(&running)) return 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) return -1;
+    atomic_store(&running, true);
+    atexit(log_stop);
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&running, false)) return;
+
+    pthread_mutex_lock(&wake_lock);
+    stopping = true;
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_join(writer, NULL);
+
+    drain();    // whatever was pushed while the writer shut down
+}
+
+/* ========== Producers ========== */
+
+void log_write(log_level_t lvl, const char *fmt, ...) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (!my_tid) my_tid = (int)syscall(SYS_gettid);
+
+    struct log_record local;
+    struct log_record *rec = &local;
+    struct log_ring *r = atomic_load_explicit(&running, memory_order_acquire) ? ring_get() : NULL;
+    unsigned long t = 0;
+
+    if (r) {
+        t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned long h = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (t - h >= LOG_RING_SIZE) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        if (t - h == LOG_RING_SIZE / 2) {
+            pthread_cond_signal(&wake_cond);    // bursting: drain before the tick
+        }
+        rec = &r->recs[t & (LOG_RING_SIZE - 1)];
+    }
+
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec->tid = my_tid;
+    rec->level = lvl < LL_NLEVELS ? lvl : LL_ERROR;
+    rec->fmt = fmt;     // a literal: formatted later by the writer
+
+    va_list ap;
+    va_start(ap, fmt);
+    pack_args(rec, fmt, ap);
+    va_end(ap);
+
+    if (r) {
+        atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+    } else {
+        // No writer (not started yet, or shut down): write it out here
+        char line[LOG_LINE_MAX];
+        write_all(record_fd(rec), line, format_record(rec, line, sizeof(line)));
+    }
+}
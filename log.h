@@ -0,0 +1,63 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * Asynchronous logger. A logging thread only captures its arguments
+ * (strings are copied) into a fixed-size record, next to a pointer to
+ * the format, and pushes it onto its own lock-free ring; it neither
+ * formats nor touches stdout. A background thread drains every ring in
+ * batches, orders the records by time, formats them and writes them
+ * with one write() per stream (warnings and errors to stderr, the rest
+ * to stdout). A ring that gets half full wakes the writer early; a full
+ * one drops the record rather than blocking.
+ *
+ * Because the format is kept by reference, it must be a string literal.
+ *
+ * Below the current level the only cost is one relaxed load and a
+ * branch. The level can be changed at any time.
+ */
+
+#define LOG_RING_SIZE  256          // records per thread (power of two)
+#define LOG_MSG_MAX    224          // argument bytes per record; also the longest message
+#define LOG_FLUSH_MS   20           // how often the writer drains the rings
+
+typedef enum {
+    LL_DEBUG = 0,
+    LL_INFO,
+    LL_WARN,
+    LL_ERROR,
+    LL_NLEVELS
+} log_level_t;
+
+extern atomic_int log_level;
+
+static inline bool log_on(log_level_t lvl) {
+    return (int)lvl >= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+/* Arguments are not evaluated when the level is filtered out */
+#define log_debug(...) do { if (log_on(LL_DEBUG)) log_write(LL_DEBUG, __VA_ARGS__); } while (0)
+#define log_info(...)  do { if (log_on(LL_INFO))  log_write(LL_INFO,  __VA_ARGS__); } while (0)
+#define log_warn(...)  do { if (log_on(LL_WARN))  log_write(LL_WARN,  __VA_ARGS__); } while (0)
+#define log_error(...) do { if (log_on(LL_ERROR)) log_write(LL_ERROR, __VA_ARGS__); } while (0)
+
+void log_write(log_level_t lvl, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Start the writer thread; records logged before this (or after
+ * log_stop) are written synchronously. log_stop drains everything still
+ * queued and is also run at exit.
+ */
+int  log_start(void);
+void log_stop(void);
+
+void        log_set_level(log_level_t lvl);
+int         log_level_parse(const char *name);     // -1 if unknown
+const char *log_level_name(log_level_t lvl);
+
+unsigned long log_dropped(void);                    // records lost to full rings
+
+#endif
@@ -0,0 +1,453 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "clock.h"
+#include "outq.h"
+#include "stats.h"
+
+struct out_chunk {
+    struct out_chunk *next;
+    uint64_t          enq_ns;
+    size_t            len, off;
+    const char       *p;            // bytes to write: data[], or into buf
+    out_buf_t        *buf;          // shared payload we hold a reference on
+    char              data[];
+};
+
+struct out_lane {
+    struct out_lane  *next;
+    struct out_chunk *head, *tail;
+    size_t            bytes;
+    bool              open;         // the stream may still add data
+    bool              full;         // went over OUTQ_MAX_LANE
+};
+
+static atomic_ulong backlogged_queues;
+static atomic_ulong dropped[OUT_NCLASSES];
+static atomic_long  queued_bytes;       // in chunks, over all queues
+static atomic_bool  shedding;
+static atomic_ulong shed_bytes;
+
+static void drain_locked(outq_t *q);
+
+#define WRITER_EVENTS 64
+
+static int writer_epfd = -1;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;    // held while flushing
+
+/*
+ * Writer thread: finishes sends to backed-up sockets that no event loop
+ * owns. The first wait is only a wakeup; the events are read again under
+ * writer_lock, which outq_destroy takes after unregistering, so a queue
+ * is never flushed once it is gone. EPOLLOUT is level-triggered and stays
+ * reported until the flush, so nothing is lost in between.
+ */
+static void *writer_main(void *arg) {
+    struct epoll_event ev[WRITER_EVENTS];
+    (void)arg;
+
+    while (1) {
+        if (epoll_wait(writer_epfd, ev, 1, -1) < 0 && errno != EINTR) break;
+
+        pthread_mutex_lock(&writer_lock);
+        int n = epoll_wait(writer_epfd, ev, WRITER_EVENTS, 0);
+        for (int i = 0; i < n; i++) outq_flush(ev[i].data.ptr);
+        pthread_mutex_unlock(&writer_lock);
+    }
+    return NULL;
+}
+
+int outq_start(void) {
+    writer_epfd = epoll_create1(0);
+    if (writer_epfd < 0) return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writer_main, NULL) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+/* Ask (or stop asking) to be told when the socket is writable; caller holds q->lock */
+static void poll_update(outq_t *q, bool out) {
+    struct epoll_event ev = { 0 };
+    if (q->poll_fd >= 0) {
+        /* The owner reads through this entry: only toggle EPOLLOUT */
+        ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+        ev.data.ptr = q->poll_ptr;
+        epoll_ctl(q->poll_fd, EPOLL_CTL_MOD, q->socket, &ev);
+    } else if (writer_epfd >= 0) {
+        ev.events = EPOLLOUT;
+        ev.data.ptr = q;
+        epoll_ctl(writer_epfd, out ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, q->socket, &ev);
+    }
+}
+
+void outq_init(outq_t *q, int socket) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->socket = socket;
+    if (socket >= 0) {
+        /* Keep the kernel's FIFO short so priorities actually apply */
+        int sz = OUTQ_SNDBUF;
+        setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+    }
+    for (int c = 0; c < OUT_NCLASSES; c++) {
+        q->head[c] = q->tail[c] = NULL;
+        q->bytes[c] = 0;
+    }
+    q->current = NULL;
+    q->lanes = q->lanes_tail = NULL;
+    q->chat_turn_ns = 0;
+    atomic_init(&q->backlogged, false);
+    q->dead = false;
+    q->poll_fd = -1;
+    q->poll_ptr = NULL;
+}
+
+out_buf_t *outbuf_new(size_t size) {
+    out_buf_t *b = malloc(sizeof(*b) + size);
+    if (b) atomic_init(&b->refs, 1);
+    return b;
+}
+
+void outbuf_put(out_buf_t *b) {
+    if (b && atomic_fetch_sub(&b->refs, 1) == 1) free(b);
+}
+
+static void chunk_free(struct out_chunk *ch) {
+    atomic_fetch_sub_explicit(&queued_bytes, (long)ch->len, memory_order_relaxed);
+    outbuf_put(ch->buf);
+    free(ch);
+}
+
+static void chunk_list_free(struct out_chunk *ch) {
+    while (ch) {
+        struct out_chunk *next = ch->next;
+        chunk_free(ch);
+        ch = next;
+    }
+}
+
+/* Drop everything queued; caller holds q->lock */
+static void clear_locked(outq_t *q) {
+    for (int c = 0; c < OUT_NCLASSES; c++) {
+        chunk_list_free(q->head[c]);
+        q->head[c] = q->tail[c] = NULL;
+        q->bytes[c] = 0;
+    }
+    /* Lanes stay until closed (or destroyed); the stream still has them */
+    for (out_lane_t *l = q->lanes; l; l = l->next) {
+        chunk_list_free(l->head);
+        l->head = l->tail = NULL;
+        l->bytes = 0;
+    }
+    if (q->current) chunk_free(q->current);
+    q->current = NULL;
+}
+
+static void set_backlogged(outq_t *q, bool on) {
+    if (atomic_load(&q->backlogged) == on) return;
+    atomic_store(&q->backlogged, on);
+
+    if (on) atomic_fetch_add(&backlogged_queues, 1);
+    else atomic_fetch_sub(&backlogged_queues, 1);
+    poll_update(q, on);
+}
+
+/* Call before the socket is closed, so its number cannot be reused meanwhile */
+void outq_destroy(outq_t *q) {
+    pthread_mutex_lock(&q->lock);
+    q->dead = true;     // never registers again
+    clear_locked(q);
+    while (q->lanes) {
+        out_lane_t *next = q->lanes->next;
+        free(q->lanes);
+        q->lanes = next;
+    }
+    set_backlogged(q, false);
+    pthread_mutex_unlock(&q->lock);
+
+    /* Wait out a writer pass that may have picked q up before it was unregistered */
+    pthread_mutex_lock(&writer_lock);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_mutex_destroy(&q->lock);
+}
+
+void outq_attach(outq_t *q, int epfd, void *ptr) {
+    pthread_mutex_lock(&q->lock);
+    bool on = atomic_load(&q->backlogged);
+    if (on) poll_update(q, false);
+    q->poll_fd = epfd;
+    q->poll_ptr = ptr;
+    if (on) poll_update(q, true);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void outq_flush(outq_t *q) {
+    pthread_mutex_lock(&q->lock);
+    drain_locked(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Next chunk to write: the front lane if it has data, else control
+ * first unless room chat is overdue a turn. Nothing else is written
+ * while the front lane is open, so a stream is never broken up.
+ */
+static struct out_chunk *pop_next(outq_t *q) {
+    while (q->lanes) {
+        out_lane_t *l = q->lanes;
+        struct out_chunk *ch = l->head;
+        if (ch) {
+            l->head = ch->next;
+            if (!l->head) l->tail = NULL;
+            l->bytes -= ch->len;
+            return ch;
+        }
+        if (l->open) return NULL;       // waiting on the stream
+        q->lanes = l->next;
+        if (!q->lanes) q->lanes_tail = NULL;
+        free(l);
+    }
+
+    int cls = OUT_CTRL;
+    if (q->head[OUT_CHAT]) {
+        uint64_t now = now_ns();
+        if (!q->head[OUT_CTRL] || now - q->chat_turn_ns >= (uint64_t)OUTQ_AGE_MS * 1000000ull) {
+            cls = OUT_CHAT;
+            q->chat_turn_ns = now;
+        }
+    }
+
+    struct out_chunk *ch = q->head[cls];
+    if (!ch) return NULL;
+    q->head[cls] = ch->next;
+    if (!q->head[cls]) q->tail[cls] = NULL;
+    q->bytes[cls] -= ch->len;
+    return ch;
+}
+
+/* Write as much as the socket takes without blocking; caller holds q->lock */
+static void drain_locked(outq_t *q) {
+    while (!q->dead) {
+        if (!q->current && !(q->current = pop_next(q))) break;
+
+        struct out_chunk *ch = q->current;
+        ssize_t n = counted_send_flags(q->socket, ch->p + ch->off, ch->len - ch->off,
+                                       MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            q->dead = true;     // the reader will notice and close the connection
+            clear_locked(q);
+            break;
+        }
+        ch->off += n;
+        if (ch->off < ch->len) break;   // socket buffer is full
+
+        chunk_free(ch);
+        q->current = NULL;
+    }
+
+    /* Data held by a paused lane is not a backlog: we could not write it */
+    bool pending = q->current ||
+                   (q->lanes ? q->lanes->head != NULL : q->head[OUT_CTRL] || q->head[OUT_CHAT]);
+    set_backlogged(q, pending);
+}
+
+static struct out_chunk *chunk_new(const void *buf, size_t len) {
+    struct out_chunk *ch = malloc(sizeof(*ch) + len);
+    if (!ch) return NULL;
+    ch->next = NULL;
+    ch->enq_ns = now_ns();
+    ch->len = len;
+    ch->off = 0;
+    ch->p = ch->data;
+    ch->buf = NULL;
+    memcpy(ch->data, buf, len);
+    atomic_fetch_add_explicit(&queued_bytes, (long)len, memory_order_relaxed);
+    return ch;
+}
+
+/* A slice of a shared buffer: one more reference, no copy */
+static struct out_chunk *chunk_ref(out_buf_t *b, size_t off, size_t len) {
+    struct out_chunk *ch = malloc(sizeof(*ch));
+    if (!ch) return NULL;
+    ch->next = NULL;
+    ch->enq_ns = now_ns();
+    ch->len = len;
+    ch->off = 0;
+    ch->p = b->data + off;
+    ch->buf = b;
+    atomic_fetch_add(&b->refs, 1);
+    atomic_fetch_add_explicit(&queued_bytes, (long)len, memory_order_relaxed);
+    return ch;
+}
+
+void outq_send(outq_t *q, out_class_t cls, const void *buf, size_t len) {
+    if (len == 0 || q->socket < 0) return;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->dead) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    /* Fast path: nothing queued, so write straight from the caller's buffer */
+    if (!atomic_load_explicit(&q->backlogged, memory_order_relaxed) && !q->lanes) {
+        ssize_t n = counted_send_flags(q->socket, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == (ssize_t)len) {
+            pthread_mutex_unlock(&q->lock);
+            return;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            q->dead = true;
+            pthread_mutex_unlock(&q->lock);
+            return;
+        }
+        if (n > 0) {
+            /* The rest of this line must go out before anything else */
+            q->current = chunk_new((const char *)buf + n, len - n);
+            set_backlogged(q, q->current != NULL);
+            pthread_mutex_unlock(&q->lock);
+            return;
+        }
+    }
+
+    /* Overloaded: a connection that is already behind loses room chat first */
+    if (cls == OUT_CHAT && atomic_load_explicit(&shedding, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&shed_bytes, len, memory_order_relaxed);
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    size_t limit = (cls == OUT_CTRL) ? OUTQ_MAX_CTRL : OUTQ_MAX_CHAT;
+    struct out_chunk *ch = NULL;
+    if (q->bytes[cls] + len <= limit) ch = chunk_new(buf, len);
+    if (!ch) {
+        atomic_fetch_add_explicit(&dropped[cls], len, memory_order_relaxed);
+    } else {
+        if (q->tail[cls]) q->tail[cls]->next = ch;
+        else q->head[cls] = ch;
+        if (cls == OUT_CHAT && ch == q->head[cls]) q->chat_turn_ns = ch->enq_ns;
+        q->tail[cls] = ch;
+        q->bytes[cls] += len;
+    }
+
+    drain_locked(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* ========== Stream lanes ========== */
+
+static void lane_append(out_lane_t *l, struct out_chunk *ch) {
+    if (l->tail) l->tail->next = ch;
+    else l->head = ch;
+    l->tail = ch;
+    l->bytes += ch->len;
+}
+
+out_lane_t *outq_lane_open(outq_t *q, const void *head, size_t len) {
+    if (q->socket < 0) return NULL;
+    out_lane_t *l = calloc(1, sizeof(*l));
+    if (!l) return NULL;
+    l->open = true;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->dead) {
+        pthread_mutex_unlock(&q->lock);
+        free(l);
+        return NULL;
+    }
+    if (q->lanes_tail) q->lanes_tail->next = l;
+    else q->lanes = l;
+    q->lanes_tail = l;
+
+    struct out_chunk *ch = len ? chunk_new(head, len) : NULL;
+    if (ch) lane_append(l, ch);
+    drain_locked(q);
+    pthread_mutex_unlock(&q->lock);
+    return l;
+}
+
+/* The lane may write right now: it is at the front and nothing is in flight */
+static inline bool lane_ready(outq_t *q, out_lane_t *l) {
+    return !q->dead && q->lanes == l && !q->current && !l->head;
+}
+
+bool outq_lane_send(outq_t *q, out_lane_t *l, out_buf_t *b, size_t off, size_t len) {
+    if (len == 0) return true;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->dead) {
+        pthread_mutex_unlock(&q->lock);
+        return true;    // nothing gets written any more; not a cut-off
+    }
+    if (l->full || l->bytes + len > OUTQ_MAX_LANE) {
+        l->full = true;
+        atomic_fetch_add_explicit(&dropped[OUT_CHAT], len, memory_order_relaxed);
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+
+    if (lane_ready(q, l)) {
+        ssize_t n = counted_send_flags(q->socket, b->data + off, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            q->dead = true;
+            clear_locked(q);
+            pthread_mutex_unlock(&q->lock);
+            return true;
+        }
+        if (n > 0) {
+            off += n;
+            len -= n;
+        }
+    }
+
+    struct out_chunk *ch = len ? chunk_ref(b, off, len) : NULL;
+    if (ch) lane_append(l, ch);
+    drain_locked(q);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+ssize_t outq_lane_direct(outq_t *q, out_lane_t *l,
+                         ssize_t (*write_fn)(int socket, void *arg), void *arg) {
+    ssize_t n = -1;
+    pthread_mutex_lock(&q->lock);
+    if (lane_ready(q, l) && !l->full) n = write_fn(q->socket, arg);
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+void outq_lane_close(outq_t *q, out_lane_t *l, const void *tail, size_t len) {
+    pthread_mutex_lock(&q->lock);
+    if (!q->dead && len) {
+        struct out_chunk *ch = chunk_new(tail, len);
+        if (ch) lane_append(l, ch);
+    }
+    l->open = false;
+    drain_locked(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+unsigned long outq_backlogged_count(void) {
+    return atomic_load(&backlogged_queues);
+}
+
+unsigned long outq_dropped(out_class_t cls) {
+    return atomic_load(&dropped[cls]);
+}
+
+size_t outq_backlog_bytes(void) {
+    long n = atomic_load(&queued_bytes);
+    return n > 0 ? (size_t)n : 0;
+}
+
+void outq_set_shedding(bool on) {
+    atomic_store(&shedding, on);
+}
+
+unsigned long outq_shed(void) {
+    return atomic_load(&shed_bytes);
+}
@@ -0,0 +1,122 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#define OUTQ_AGE_MS        50               // room chat gets a turn at least this often
+#define OUTQ_SNDBUF        (32 * 1024)      // kernel send buffer; the rest is queued by priority
+#define OUTQ_MAX_CTRL      (1024 * 1024)    // queued bytes per class before new data is dropped
+#define OUTQ_MAX_CHAT      (256 * 1024)
+#define OUTQ_MAX_LANE      (1024 * 1024)    // queued bytes per stream lane before it is cut off
+
+/* Outbound priority classes, highest first */
+typedef enum {
+    OUT_CTRL = 0,       // command replies and DMs
+    OUT_CHAT,           // room chat, batches and presence events
+    OUT_NCLASSES
+} out_class_t;
+
+struct out_chunk;
+struct out_lane;
+typedef struct out_lane out_lane_t;
+
+/*
+ * Reference-counted payload that many queues can hold at once without
+ * copying it (streamed pastes). The creator owns the first reference.
+ */
+typedef struct out_buf {
+    atomic_int refs;
+    char       data[];
+} out_buf_t;
+
+out_buf_t *outbuf_new(size_t size);
+void       outbuf_put(out_buf_t *b);
+
+/*
+ * Per-connection outbound queue. Sends never block: whatever the socket
+ * does not take right away is queued by class and written later, control
+ * first. Room chat that has made no progress for OUTQ_AGE_MS gets the
+ * next turn, so a steady stream of control data cannot starve it. A
+ * partly written chunk is always finished before another one starts, so
+ * lines are never interleaved.
+ *
+ * A backed-up socket is finished when epoll says it is writable again,
+ * by the loop that owns the connection (its shard, see outq_attach) or
+ * else by the outq writer thread.
+ */
+typedef struct outq {
+    pthread_mutex_t   lock;
+    int               socket;
+    struct out_chunk *head[OUT_NCLASSES];
+    struct out_chunk *tail[OUT_NCLASSES];
+    size_t            bytes[OUT_NCLASSES];
+    struct out_chunk *current;      // partly written
+    out_lane_t       *lanes;        // streams to this connection, oldest first
+    out_lane_t       *lanes_tail;
+    uint64_t          chat_turn_ns; // last time room chat was written or first queued
+    atomic_bool       backlogged;   // something is queued
+    bool              dead;         // socket failed; drop everything
+    int               poll_fd;      // owner's epoll, or -1 for the writer thread
+    void             *poll_ptr;     // owner's epoll data for the socket
+} outq_t;
+
+/* Start the writer thread for connections that have no event loop */
+int  outq_start(void);
+
+void outq_init(outq_t *q, int socket);
+void outq_destroy(outq_t *q);
+
+/*
+ * Hand q's backlog over to an event loop that already reads the socket
+ * through epfd with ptr as its data: EPOLLOUT is added to that entry
+ * while q is backlogged, and the loop calls outq_flush when it fires.
+ * epfd -1 hands it back to the writer thread; do that before removing
+ * the socket from epfd.
+ */
+void outq_attach(outq_t *q, int epfd, void *ptr);
+void outq_flush(outq_t *q);
+
+/* Queue buf behind anything already pending in cls and write what we can */
+void outq_send(outq_t *q, out_class_t cls, const void *buf, size_t len);
+
+/*
+ * Lanes carry a streamed message that is sent over many calls. While a
+ * lane is at the front of the queue, everything else (replies, DMs,
+ * pings, room chat and later lanes) waits behind it, so nothing is
+ * written into the middle of the stream. The streaming side must make
+ * sure the lane gets closed, and in bounded time.
+ *
+ * outq_lane_open queues head (copied) first and returns NULL if the
+ * connection is gone. outq_lane_send queues a slice of a shared buffer
+ * by reference, writing straight away when it can; it returns false once
+ * the lane has more than OUTQ_MAX_LANE queued and takes no more data.
+ * outq_lane_direct runs write_fn(socket, arg) under the queue lock if
+ * the lane is at the front with nothing pending, for callers that have
+ * their own way to write (splice); it returns what write_fn wrote, or
+ * -1 if the lane cannot be written directly right now. outq_lane_close
+ * queues tail (copied) and lets the connection move on; l must not be
+ * used afterwards.
+ */
+out_lane_t *outq_lane_open(outq_t *q, const void *head, size_t len);
+bool        outq_lane_send(outq_t *q, out_lane_t *l, out_buf_t *b, size_t off, size_t len);
+ssize_t     outq_lane_direct(outq_t *q, out_lane_t *l,
+                             ssize_t (*write_fn)(int socket, void *arg), void *arg);
+void        outq_lane_close(outq_t *q, out_lane_t *l, const void *tail, size_t len);
+
+unsigned long outq_backlogged_count(void);
+unsigned long outq_dropped(out_class_t cls);
+size_t        outq_backlog_bytes(void);        // queued over all connections
+
+/*
+ * Load shedding (see overload.h): while on, room chat for a connection
+ * that cannot take it right away is dropped instead of queued.
+ */
+void          outq_set_shedding(bool on);
+unsigned long outq_shed(void);                 // bytes shed
+
+#endif
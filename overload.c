@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "overload.h"
+#include "outq.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "wheel.h"
+#include "log.h"
+
+atomic_bool overloaded = false;
+atomic_bool overload_shed_on = false;
+
+static struct overload_config cfg;
+static wheel_timer_t tick;
+
+static atomic_ulong value[OVL_NSIGNALS];
+static atomic_ulong episodes;
+static atomic_ulong refused;
+
+static uint64_t calm_ms;                    // how long every signal has been under the clear mark
+static unsigned long last_wait_sum, last_wait_count;
+
+static const char *signal_names[OVL_NSIGNALS] = { "queue", "backlog", "lock", "conns" };
+static const char *action_names[] = { "refuse", "shed", "throttle" };
+
+/* ========== Option parsing ========== */
+
+int overload_parse_limits(const char *spec, unsigned long *limit) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    char *save = NULL;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+
+        int s;
+        for (s = 0; s < OVL_NSIGNALS; s++) {
+            if (strcmp(item, signal_names[s]) == 0) break;
+        }
+        char *end;
+        unsigned long v = strtoul(eq + 1, &end, 10);
+        if (s == OVL_NSIGNALS || end == eq + 1 || *end) return -1;
+        limit[s] = v;
+    }
+    return 0;
+}
+
+int overload_parse_actions(const char *spec, unsigned *actions) {
+    if (strcmp(spec, "none") == 0) {
+        *actions = 0;
+        return 0;
+    }
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    unsigned a = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        size_t i;
+        for (i = 0; i < sizeof(action_names) / sizeof(action_names[0]); i++) {
+            if (strcmp(item, action_names[i]) == 0) break;
+        }
+        if (i == sizeof(action_names) / sizeof(action_names[0])) return -1;
+        a |= 1u << i;
+    }
+    *actions = a;
+    return 0;
+}
+
+/* ========== Sampling ========== */
+
+static unsigned long sample(ovl_signal_t s) {
+    switch (s) {
+    case OVL_QUEUE:
+        return cfg.queue_depth ? cfg.queue_depth() : 0;
+    case OVL_BACKLOG:
+        return outq_backlog_bytes() / 1024;
+    case OVL_LOCK: {
+        /* Mean wait since the last tick, read and write side together */
+        unsigned long sum = atomic_load(&stats.lock_read_wait_ns.sum) +
+                            atomic_load(&stats.lock_write_wait_ns.sum);
+        unsigned long count = atomic_load(&stats.lock_read_wait_ns.count) +
+                              atomic_load(&stats.lock_write_wait_ns.count);
+        unsigned long dsum = sum - last_wait_sum, dcount = count - last_wait_count;
+        last_wait_sum = sum;
+        last_wait_count = count;
+        return dcount ? dsum / dcount / 1000 : 0;
+    }
+    case OVL_CONNS:
+        return cfg.max_clients ? atomic_load(&stats.conns_active) * 100 / cfg.max_clients : 0;
+    default:
+        return 0;
+    }
+}
+
+static void apply(bool on) {
+    atomic_store(&overloaded, on);
+    atomic_store(&overload_shed_on, on && (cfg.actions & OVL_SHED));
+    outq_set_shedding(on && (cfg.actions & OVL_SHED));
+    ratelimit_set_scale((on && (cfg.actions & OVL_THROTTLE)) ? OVERLOAD_THROTTLE_PCT : 100);
+}
+
+static void tick_due(wheel_timer_t *t, void *arg) {
+    (void)arg;
+    int over = -1;
+    bool calm = true;
+
+    for (int s = 0; s < OVL_NSIGNALS; s++) {
+        unsigned long v = sample(s);
+        atomic_store(&value[s], v);
+        if (!cfg.limit[s]) continue;
+        if (v > cfg.limit[s] && over < 0) over = s;
+        if (v * 100 >= cfg.limit[s] * OVERLOAD_CLEAR_PCT) calm = false;
+    }
+
+    if (!overload_on()) {
+        if (over >= 0) {
+            apply(true);
+            atomic_fetch_add(&episodes, 1);
+            calm_ms = 0;
+            log_warn("Overloaded: %s at %lu (limit %lu); refuse=%s shed=%s throttle=%s",
+                     signal_names[over], atomic_load(&value[over]), cfg.limit[over],
+                     (cfg.actions & OVL_REFUSE) ? "on" : "off",
+                     (cfg.actions & OVL_SHED) ? "on" : "off",
+                     (cfg.actions & OVL_THROTTLE) ? "on" : "off");
+        }
+    } else if (calm) {
+        calm_ms += OVERLOAD_TICK_MS;
+        if (calm_ms >= OVERLOAD_CALM_MS) {
+            apply(false);
+            log_info("Overload cleared");
+        }
+    } else {
+        calm_ms = 0;
+    }
+
+    wheel_arm(t, OVERLOAD_TICK_MS);
+}
+
+void overload_start(const struct overload_config *c) {
+    cfg = *c;
+    wheel_timer_init(&tick, tick_due, NULL);
+    wheel_arm(&tick, OVERLOAD_TICK_MS);
+}
+
+bool overload_admit(void) {
+    /* Reserve the slot now: the connection is set up later, on another thread */
+    unsigned long conns = atomic_fetch_add(&stats.conns_active, 1);
+    bool full = cfg.max_clients && conns >= cfg.max_clients;
+    if (full || (overload_on() && (cfg.actions & OVL_REFUSE))) {
+        atomic_fetch_sub(&stats.conns_active, 1);
+        atomic_fetch_add(&refused, 1);
+        return false;
+    }
+    return true;
+}
+
+/* ========== Counters ========== */
+
+const char *overload_signal_name(ovl_signal_t s) {
+    return s < OVL_NSIGNALS ? signal_names[s] : "unknown";
+}
+
+unsigned long overload_signal(ovl_signal_t s) {
+    return s < OVL_NSIGNALS ? atomic_load(&value[s]) : 0;
+}
+
+unsigned long overload_limit(ovl_signal_t s) {
+    return s < OVL_NSIGNALS ? cfg.limit[s] : 0;
+}
+
+unsigned long overload_episodes(void) {
+    return atomic_load(&episodes);
+}
+
+unsigned long overload_refused(void) {
+    return atomic_load(&refused);
+}
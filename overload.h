@@ -0,0 +1,96 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Overload detection and load shedding. A wheel timer samples four
+ * signals every OVERLOAD_TICK_MS:
+ *
+ *   queue    chat lines waiting in shard inboxes (sharded mode only)
+ *   backlog  KiB queued in outqs, summed over all connections
+ *   lock     mean list-lock wait over the last tick, in microseconds
+ *   conns    connections as a percentage of max clients
+ *
+ * The server is overloaded while any signal is over its limit, and
+ * recovers once every signal has stayed under OVERLOAD_CLEAR_PCT of its
+ * limit for OVERLOAD_CALM_MS. While overloaded the configured actions
+ * apply:
+ *
+ *   refuse    new connections get a busy message and are closed
+ *   shed      room chat to connections that are already backed up is
+ *             dropped, and new pastes are refused (replies and DMs are
+ *             never shed)
+ *   throttle  per-user rate limits refill at OVERLOAD_THROTTLE_PCT
+ *
+ * Connections at or over max clients are refused regardless.
+ */
+
+#define OVERLOAD_TICK_MS      100
+#define OVERLOAD_CALM_MS      1000
+#define OVERLOAD_CLEAR_PCT    75
+#define OVERLOAD_THROTTLE_PCT 50
+
+/* Default limits */
+#define DEFAULT_OVL_QUEUE     2048      // messages
+#define DEFAULT_OVL_BACKLOG   65536     // KiB
+#define DEFAULT_OVL_LOCK      5000      // microseconds
+#define DEFAULT_OVL_CONNS     90        // percent of max clients
+
+typedef enum {
+    OVL_QUEUE = 0,
+    OVL_BACKLOG,
+    OVL_LOCK,
+    OVL_CONNS,
+    OVL_NSIGNALS
+} ovl_signal_t;
+
+/* Actions (bit mask) */
+#define OVL_REFUSE    (1u << 0)
+#define OVL_SHED      (1u << 1)
+#define OVL_THROTTLE  (1u << 2)
+#define DEFAULT_OVL_ACTIONS (OVL_REFUSE | OVL_SHED)
+
+struct overload_config {
+    unsigned long limit[OVL_NSIGNALS];  // 0 disables that signal
+    unsigned      actions;
+    unsigned long max_clients;
+    size_t      (*queue_depth)(void);   // NULL: no fan-out queue (thread per client)
+};
+
+/* "queue=N,backlog=KiB,lock=us,conns=pct" (any subset); -1 if malformed */
+int  overload_parse_limits(const char *spec, unsigned long *limit);
+/* "refuse,shed,throttle" (any subset) or "none"; -1 if malformed */
+int  overload_parse_actions(const char *spec, unsigned *actions);
+
+void overload_start(const struct overload_config *cfg);
+
+/*
+ * Accept-time check: false when the connection must be turned away
+ * (counted as refused). An admitted connection holds a slot in
+ * stats.conns_active from here on; client_close gives it back.
+ */
+bool overload_admit(void);
+
+extern atomic_bool overloaded;
+
+static inline bool overload_on(void) {
+    return atomic_load_explicit(&overloaded, memory_order_relaxed);
+}
+
+/* Overloaded with the shed action enabled */
+extern atomic_bool overload_shed_on;
+
+static inline bool overload_shedding(void) {
+    return atomic_load_explicit(&overload_shed_on, memory_order_relaxed);
+}
+
+const char   *overload_signal_name(ovl_signal_t s);
+unsigned long overload_signal(ovl_signal_t s);     // last sampled value
+unsigned long overload_limit(ovl_signal_t s);
+unsigned long overload_episodes(void);
+unsigned long overload_refused(void);
+
+#endif
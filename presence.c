@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "presence.h"
+
+#define PRESENCE_MAXLINE 128
+
+static pthread_mutex_t sub_lock = PTHREAD_MUTEX_INITIALIZER;
+static user_t **subs;
+static int nsubs, subs_cap;
+static atomic_int nsubs_hint;       // lets the observer skip the lock when nobody listens
+
+static const char *event_names[] = {
+    [LIST_USER_ADD]    = "user-add",
+    [LIST_USER_DEL]    = "user-del",
+    [LIST_USER_RENAME] = "user-rename",
+    [LIST_ROOM_ADD]    = "room-add",
+    [LIST_JOIN]        = "join",
+    [LIST_LEAVE]       = "leave",
+};
+
+static void presence_event(list_event_t ev, const char *a, const char *b) {
+    if (atomic_load_explicit(&nsubs_hint, memory_order_relaxed) == 0) return;
+
+    char line[PRESENCE_MAXLINE];
+    int n = b ? snprintf(line, sizeof(line), "\n@%s %s %s\nchat>", event_names[ev], a, b)
+              : snprintf(line, sizeof(line), "\n@%s %s\nchat>", event_names[ev], a);
+
+    pthread_mutex_lock(&sub_lock);
+    for (int i = 0; i < nsubs; i++) {
+        outq_send(&subs[i]->out, OUT_CHAT, line, n);
+    }
+    pthread_mutex_unlock(&sub_lock);
+}
+
+void presence_start(void) {
+    list_set_observer(presence_event);
+}
+
+bool presence_subscribe(user_t *u) {
+    bool ok = false;
+    pthread_mutex_lock(&sub_lock);
+    int i = 0;
+    while (i < nsubs && subs[i] != u) i++;
+    if (i == nsubs) {
+        if (nsubs == subs_cap) {
+            int cap = subs_cap ? subs_cap * 2 : 16;
+            user_t **v = realloc(subs, cap * sizeof(*v));
+            if (v) {
+                subs = v;
+                subs_cap = cap;
+            }
+        }
+        if (nsubs < subs_cap) {
+            subs[nsubs++] = u;
+            atomic_store(&nsubs_hint, nsubs);
+            ok = true;
+        }
+    }
+    pthread_mutex_unlock(&sub_lock);
+    return ok;
+}
+
+bool presence_unsubscribe(user_t *u) {
+    bool found = false;
+    pthread_mutex_lock(&sub_lock);
+    for (int i = 0; i < nsubs; i++) {
+        if (subs[i] == u) {
+            subs[i] = subs[--nsubs];
+            atomic_store(&nsubs_hint, nsubs);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sub_lock);
+    return found;
+}
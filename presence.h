@@ -0,0 +1,21 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "list.h"
+
+/*
+ * Presence push: clients that `subscribe presence` get one short line
+ * per change instead of polling `users` and `rooms`:
+ *
+ *   @user-add <user>       @user-del <user>      @user-rename <old> <new>
+ *   @room-add <room>       @join <user> <room>   @leave <user> <room>
+ *
+ * Events come from list.c's observer hook, so federated (proxy) users
+ * are covered too.
+ */
+
+void presence_start(void);                  // hook into list.c
+bool presence_subscribe(user_t *u);         // false if already subscribed or out of memory
+bool presence_unsubscribe(user_t *u);       // false if not subscribed
+
+#endif
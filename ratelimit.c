@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdatomic.h>
+#include "clock.h"
+#include "ratelimit.h"
+
+/* How often each limit fired, per traffic class */
+static atomic_ulong delayed_count[RL_NCLASSES];
+static atomic_ulong dropped_count[RL_NCLASSES];
+
+/* Percentage of the configured rate buckets refill at (overload throttle) */
+static atomic_int rate_pct = 100;
+
+static const char *class_names[RL_NCLASSES] = { "chat", "cmd" };
+
+void bucket_init(token_bucket_t *b, double rate, double burst) {
+    if (!b) return;
+
+    if (burst < 1.0) burst = 1.0;
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;          // start full so logins aren't penalized
+    b->last_ns = now_ns();
+}
+
+static inline double bucket_rate(const token_bucket_t *b) {
+    return b->rate * atomic_load_explicit(&rate_pct, memory_order_relaxed) / 100.0;
+}
+
+static void bucket_refill(token_bucket_t *b, uint64_t now) {
+    double elapsed = (double)(now - b->last_ns) / 1e9;
+    b->tokens += elapsed * bucket_rate(b);
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last_ns = now;
+}
+
+rl_result_t bucket_take(token_bucket_t *b, rl_class_t cls, int max_delay_ms) {
+    if (!b || b->rate <= 0) return RL_PASS;   // unlimited
+
+    bucket_refill(b, now_ns());
+    if (b->tokens >= 1.0) {
+        b->tokens -= 1.0;
+        return RL_PASS;
+    }
+
+    /* Time until the next whole token arrives */
+    uint64_t wait_ns = (uint64_t)((1.0 - b->tokens) / bucket_rate(b) * 1e9);
+    if (wait_ns > (uint64_t)max_delay_ms * 1000000ull) {
+        atomic_fetch_add(&dropped_count[cls], 1);
+        return RL_DROPPED;
+    }
+
+    sleep_ns(wait_ns);
+    bucket_refill(b, now_ns());
+    b->tokens -= 1.0;
+    atomic_fetch_add(&delayed_count[cls], 1);
+    return RL_DELAYED;
+}
+
+void ratelimit_set_scale(int pct) {
+    if (pct < 1) pct = 1;
+    atomic_store(&rate_pct, pct);
+}
+
+unsigned long ratelimit_delayed(rl_class_t cls) {
+    return atomic_load(&delayed_count[cls]);
+}
+
+unsigned long ratelimit_dropped(rl_class_t cls) {
+    return atomic_load(&dropped_count[cls]);
+}
+
+void ratelimit_report(char *buffer, size_t len) {
+    if (!buffer || len == 0) return;
+
+    size_t off = 0;
+    buffer[0] = '\0';
+    for (int c = 0; c < RL_NCLASSES && off < len; c++) {
+        off += snprintf(buffer + off, len - off, "ratelimit %s: delayed=%lu dropped=%lu\n",
+                        class_names[c], ratelimit_delayed(c), ratelimit_dropped(c));
+    }
+}
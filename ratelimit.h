@@ -0,0 +1,50 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Token bucket: holds up to `burst` tokens and refills at `rate`
+ * tokens per second. A rate of 0 disables the limit.
+ *
+ * Each bucket is owned by a single client thread, so no locking
+ * is needed on the bucket itself. Only the counters are shared.
+ */
+typedef struct token_bucket {
+    double   tokens;
+    double   rate;        // tokens per second
+    double   burst;       // bucket capacity
+    uint64_t last_ns;     // last refill time
+} token_bucket_t;
+
+/* Traffic classes that get their own bucket (and counters) */
+typedef enum {
+    RL_CHAT = 0,          // chat lines (fan-out)
+    RL_CMD,               // mutating commands: create, join, login
+    RL_NCLASSES
+} rl_class_t;
+
+typedef enum {
+    RL_PASS = 0,          // token available, go ahead
+    RL_DELAYED,           // waited for a token, go ahead
+    RL_DROPPED            // over limit for too long, drop the input
+} rl_result_t;
+
+void        bucket_init(token_bucket_t *b, double rate, double burst);
+
+/*
+ * Take one token. If none is available and the next one arrives within
+ * max_delay_ms, sleep until then (RL_DELAYED); otherwise RL_DROPPED.
+ */
+rl_result_t bucket_take(token_bucket_t *b, rl_class_t cls, int max_delay_ms);
+
+/* Refill every bucket at pct percent of its rate (100 = as configured) */
+void        ratelimit_set_scale(int pct);
+
+/* Counters */
+unsigned long ratelimit_delayed(rl_class_t cls);
+unsigned long ratelimit_dropped(rl_class_t cls);
+void          ratelimit_report(char *buffer, size_t len);
+
+#endif
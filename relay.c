@@ -0,0 +1,209 @@
+/*
+ * relay - local message bus for federated chat servers.
+ *
+ * Usage: relay [socket_path]
+ *
+ * Accepts chat server processes on a Unix domain socket and forwards
+ * every frame from one node to all the others. When a node disconnects
+ * the others get FED_NODE_DOWN so they can drop its users.
+ *
+ * Node sockets are nonblocking and each node has its own outbound queue,
+ * so one slow node cannot stall the bus. A node that falls more than
+ * RELAY_MAX_QUEUE bytes behind is disconnected like one that left.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "relay.h"
+
+#define MAX_NODES        64
+#define RELAY_MAX_QUEUE  (8 * 1024 * 1024)  // bytes queued for one node before it is dropped
+
+struct node {
+    int      fd;
+    uint32_t origin;                    // learned from the node's first frame
+    char     buf[sizeof(struct fed_hdr) + FED_MAX_PAYLOAD];
+    size_t   have;                      // bytes of the current frame received
+    char    *out;                       // frames the socket has not taken yet
+    size_t   out_off, out_len, out_cap;
+    int      failed;                    // write error or too far behind; drop it
+};
+
+static struct node nodes[MAX_NODES];
+static int nnodes = 0;
+
+/* Write queued bytes until the socket would block */
+static void flush_node(struct node *n) {
+    while (n->out_off < n->out_len) {
+        ssize_t k = write(n->fd, n->out + n->out_off, n->out_len - n->out_off);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) n->failed = 1;
+            break;
+        }
+        n->out_off += k;
+    }
+    if (n->out_off == n->out_len) n->out_off = n->out_len = 0;
+}
+
+/* Queue a frame behind anything pending and write what the socket takes */
+static void node_send(struct node *n, const void *frame, size_t len) {
+    if (n->failed) return;
+
+    if (n->out_off > 0) {
+        memmove(n->out, n->out + n->out_off, n->out_len - n->out_off);
+        n->out_len -= n->out_off;
+        n->out_off = 0;
+    }
+    if (n->out_len + len > RELAY_MAX_QUEUE) {
+        printf("relay: node %u is %zu bytes behind, dropping it\n", n->origin, n->out_len);
+        n->failed = 1;
+        return;
+    }
+    if (n->out_len + len > n->out_cap) {
+        size_t cap = n->out_cap ? n->out_cap : 65536;
+        while (cap < n->out_len + len) cap *= 2;
+        char *p = realloc(n->out, cap);
+        if (!p) {
+            n->failed = 1;
+            return;
+        }
+        n->out = p;
+        n->out_cap = cap;
+    }
+    memcpy(n->out + n->out_len, frame, len);
+    n->out_len += len;
+    flush_node(n);
+}
+
+static void forward(int from, const void *frame, size_t len) {
+    for (int i = 0; i < nnodes; i++) {
+        if (i == from) continue;
+        node_send(&nodes[i], frame, len);
+    }
+}
+
+static void drop_node(int i) {
+    uint32_t origin = nodes[i].origin;
+    close(nodes[i].fd);
+    free(nodes[i].out);
+    nodes[i] = nodes[--nnodes];
+
+    if (origin != 0) {
+        struct fed_hdr h = { .len = 0, .origin = origin, .type = FED_NODE_DOWN };
+        forward(-1, &h, sizeof(h));
+    }
+    printf("relay: node %u left (%d connected)\n", origin, nnodes);
+}
+
+/* Read what is available; forward each complete frame. Returns -1 on close. */
+static int service_node(int i) {
+    struct node *n = &nodes[i];
+    size_t want = sizeof(struct fed_hdr);
+    if (n->have >= want) {
+        want += ((struct fed_hdr *)n->buf)->len;
+    }
+
+    ssize_t got = read(n->fd, n->buf + n->have, want - n->have);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (got <= 0) return -1;
+    n->have += got;
+
+    if (n->have == sizeof(struct fed_hdr)) {
+        struct fed_hdr *h = (struct fed_hdr *)n->buf;
+        if (h->len > FED_MAX_PAYLOAD) return -1;    // protocol error
+        if (n->origin == 0) {
+            n->origin = h->origin;
+            printf("relay: node %u joined (%d connected)\n", n->origin, nnodes);
+        }
+        if (h->len > 0) return 0;                   // wait for payload
+    }
+
+    struct fed_hdr *h = (struct fed_hdr *)n->buf;
+    if (n->have == sizeof(struct fed_hdr) + h->len) {
+        forward(i, n->buf, n->have);
+        n->have = 0;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = (argc > 1) ? argv[1] : DEFAULT_RELAY_PATH;
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);   // keep the join/leave log readable when piped
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 16) < 0) {
+        perror("bind/listen");
+        exit(EXIT_FAILURE);
+    }
+    printf("relay: listening on %s\n", path);
+
+    while (1) {
+        struct pollfd pfds[MAX_NODES + 1];
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < nnodes; i++) {
+            pfds[i + 1].fd = nodes[i].fd;
+            pfds[i + 1].events = POLLIN | (nodes[i].out_len ? POLLOUT : 0);
+        }
+
+        if (poll(pfds, nnodes + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        /* Walk backwards so drop_node's swap-with-last is safe */
+        for (int i = nnodes - 1; i >= 0; i--) {
+            if (pfds[i + 1].revents & POLLOUT) flush_node(&nodes[i]);
+            if (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (service_node(i) < 0) drop_node(i);
+            }
+        }
+
+        /* Drop nodes that failed or fell behind; each drop is news to the rest */
+        for (int i = nnodes - 1; i >= 0; i--) {
+            if (nodes[i].failed) {
+                drop_node(i);
+                i = nnodes;     // rescan: the FED_NODE_DOWN may have failed others
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd >= 0) {
+                if (nnodes == MAX_NODES) {
+                    close(fd);
+                } else {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    memset(&nodes[nnodes], 0, sizeof(struct node));
+                    nodes[nnodes++].fd = fd;
+                }
+            }
+        }
+    }
+
+    close(lfd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+
+/*
+ * Wire protocol between chat servers and the local relay daemon.
+ *
+ * Every frame is a fixed header followed by `len` payload bytes. The
+ * payload is up to three NUL-terminated strings (user, room/peer, text).
+ * The relay forwards every frame it receives to every other node and
+ * only generates FED_NODE_DOWN itself.
+ */
+
+#define DEFAULT_RELAY_PATH "/tmp/bisonchat.relay"
+#define FED_MAX_PAYLOAD    4096
+
+enum fed_type {
+    FED_HELLO = 1,      // node joined the bus; others reply with their state
+    FED_USER_ADD,       // user
+    FED_USER_DEL,       // user
+    FED_RENAME,         // old name, new name
+    FED_ROOM_ADD,       // room
+    FED_JOIN,           // user, room
+    FED_LEAVE,          // user, room
+    FED_DM_ADD,         // from, to
+    FED_DM_DEL,         // from, to
+    FED_MSG,            // user, text
+    FED_NODE_DOWN,      // (relay only) node `origin` went away
+    FED_PRIVMSG         // from, to, text (direct message to one user)
+};
+
+struct fed_hdr {
+    uint32_t len;       // payload bytes following the header
+    uint32_t origin;    // node id of the sender (its pid)
+    uint8_t  type;      // enum fed_type
+    uint8_t  pad[3];
+};
+
+#endif
@@ -1,4 +1,12 @@
+#include <errno.h>
+#include <limits.h>
 #include "server.h"
+#include "fed.h"
+#include "shard.h"
+#include "stats.h"
+#include "trace.h"
+#include "presence.h"
+#include "log.h"
 
 int chat_serv_sock_fd; //server socket
 
@@ -14,16 +22,164 @@ pthread_mutex_t rw_lock = PTHREAD_MUTEX_INITIALIZER;  // read/write lock
 
 const char *server_MOTD = "Thanks for connecting to the BisonChat Server.\n\nchat>";
 
+struct server_config config = {
+   .chat_rate    = DEFAULT_CHAT_RATE,
+   .chat_burst   = DEFAULT_CHAT_BURST,
+   .cmd_rate     = DEFAULT_CMD_RATE,
+   .cmd_burst    = DEFAULT_CMD_BURST,
+   .max_delay_ms = DEFAULT_MAX_DELAY_MS,
+   .port         = PORT,
+   .relay_path   = NULL,
+   .shards       = 0,
+   .metrics_path = NULL,
+   .trace_path   = NULL,
+   .single       = false,
+   .max_users    = DEFAULT_MAX_USERS,
+   .max_rooms    = DEFAULT_MAX_ROOMS,
+   .ping_s       = 0,
+   .reap_s       = DEFAULT_REAP_S,
+   .overload     = {
+      .limit = { DEFAULT_OVL_QUEUE, DEFAULT_OVL_BACKLOG, DEFAULT_OVL_LOCK, DEFAULT_OVL_CONNS },
+      .actions = DEFAULT_OVL_ACTIONS,
+   },
+};
+
+static void usage(const char *prog) {
+   fprintf(stderr,
+      "Usage: %s [options]\n"
+      "  -r <rate>   chat messages per second per user (0 = unlimited, default %d)\n"
+      "  -b <burst>  chat burst size (default %d)\n"
+      "  -R <rate>   create/join/login commands per second per user (0 = unlimited, default %d)\n"
+      "  -B <burst>  command burst size (default %d)\n"
+      "  -d <ms>     max time to delay over-limit input before dropping it (default %d)\n"
+      "  -p <port>   port to listen on (default %d)\n"
+      "  -f <path>   federate with other servers through the relay at path\n"
+      "              (\"-\" for %s)\n"
+      "  -w <n>      sharded mode: n event-loop workers, one per core (default: thread per client)\n"
+      "  -m <path>   serve metrics as text on a Unix socket at path\n"
+      "  -t <file>   trace from startup and write a Chrome trace to file on exit\n"
+      "  -s          single membership: one room and one DM per user; joining\n"
+      "              a room leaves the previous one (use on every federated node)\n"
+      "  -U <n>      max users, local and federated (default %d)\n"
+      "  -C <n>      max rooms (default %d)\n"
+      "  -k <s>      ping clients silent for s seconds (0 = off, the default)\n"
+      "  -K <s>      disconnect if still silent s seconds after the ping (default %d)\n"
+      "  -l <level>  log level: debug, info, warn or error (default info; the\n"
+      "              admin command \"log <level>\" changes it at runtime)\n"
+      "  -c <n>      max clients; more are turned away (default: max users)\n"
+      "  -o <limits> overload limits, any of queue=<msgs>,backlog=<KiB>,lock=<us>,\n"
+      "              conns=<%% of max clients>; 0 disables one (default queue=%d,\n"
+      "              backlog=%d,lock=%d,conns=%d)\n"
+      "  -O <acts>   while overloaded: any of refuse,shed,throttle, or none\n"
+      "              (default refuse,shed)\n",
+      prog, DEFAULT_CHAT_RATE, DEFAULT_CHAT_BURST, DEFAULT_CMD_RATE, DEFAULT_CMD_BURST,
+      DEFAULT_MAX_DELAY_MS, PORT, DEFAULT_RELAY_PATH, DEFAULT_MAX_USERS, DEFAULT_MAX_ROOMS,
+      DEFAULT_REAP_S, DEFAULT_OVL_QUEUE, DEFAULT_OVL_BACKLOG, DEFAULT_OVL_LOCK,
+      DEFAULT_OVL_CONNS);
+}
+
+/* Turn a connection away without starting anything for it */
+static void refuse_client(int client) {
+   const char *busy = "Server busy, please try again later\n";
+   send(client, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+   close(client);
+}
+
 int main(int argc, char **argv) {
 
+   int opt;
+   while ((opt = getopt(argc, argv, "r:b:R:B:d:p:f:w:m:t:sU:C:k:K:l:c:o:O:h")) != -1) {
+      switch (opt) {
+         case 'r': config.chat_rate = atof(optarg); break;
+         case 'b': config.chat_burst = atof(optarg); break;
+         case 'R': config.cmd_rate = atof(optarg); break;
+         case 'B': config.cmd_burst = atof(optarg); break;
+         case 'd': {
+            char *end;
+            long ms = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end || ms < 0 || ms > INT_MAX) {
+               usage(argv[0]);     // a negative threshold would turn dropping off
+               exit(1);
+            }
+            config.max_delay_ms = (int)ms;
+            break;
+         }
+         case 'p': config.port = atoi(optarg); break;
+         case 'w': config.shards = atoi(optarg); break;
+         case 'm': config.metrics_path = optarg; break;
+         case 't': config.trace_path = optarg; break;
+         case 's': config.single = true; break;
+         case 'U': config.max_users = atoi(optarg); break;
+         case 'C': config.max_rooms = atoi(optarg); break;
+         case 'k': config.ping_s = atoi(optarg); break;
+         case 'K': config.reap_s = atoi(optarg); break;
+         case 'l':
+            if (log_level_parse(optarg) < 0) {
+               usage(argv[0]);
+               exit(1);
+            }
+            log_set_level(log_level_parse(optarg));
+            break;
+         case 'c': config.overload.max_clients = strtoul(optarg, NULL, 10); break;
+         case 'o':
+            if (overload_parse_limits(optarg, config.overload.limit) < 0) {
+               usage(argv[0]);
+               exit(1);
+            }
+            break;
+         case 'O':
+            if (overload_parse_actions(optarg, &config.overload.actions) < 0) {
+               usage(argv[0]);
+               exit(1);
+            }
+            break;
+         case 'f':
+            config.relay_path = strcmp(optarg, "-") == 0 ? DEFAULT_RELAY_PATH : optarg;
+            break;
+         default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+      }
+   }
+
+   // Everything below logs through the background writer
+   if (log_start() != 0) {
+      fprintf(stderr, "Error starting logger\n");
+      exit(1);
+   }
+
+   if (config.trace_path) {
+      trace_set(true);
+   }
+   single_membership = config.single;
+   if (list_init(config.max_users, config.max_rooms) != 0) {
+      log_error("Error allocating %d users / %d rooms (max %u each)",
+                config.max_users, config.max_rooms, MAX_ARENA_SLOTS);
+      exit(1);
+   }
+   presence_start();
+
    signal(SIGINT, sigintHandler);
+   signal(SIGPIPE, SIG_IGN);   // a dead peer or relay must not kill the server
     
    //////////////////////////////////////////////////////
    // create the default room for all clients to join when 
    // initially connecting
    //////////////////////////////////////////////////////
    if (!create_room(DEFAULT_ROOM)) {
-       fprintf(stderr, "Error creating default room '%s'\n", DEFAULT_ROOM);
+       log_error("Error creating default room '%s'", DEFAULT_ROOM);
+       exit(1);
+   }
+
+   // Start the timer wheel (batching windows, keepalives, paste deadlines)
+   if (wheel_start() != 0) {
+       log_error("Error starting timer wheel");
+       exit(1);
+   }
+
+   // Start the writer for backed-up sockets of thread-per-client connections
+   if (outq_start() != 0) {
+       log_error("Error starting output writer");
        exit(1);
    }
 
@@ -32,19 +188,65 @@ int main(int argc, char **argv) {
 
    // get ready to accept connections
    if(start_server(chat_serv_sock_fd, BACKLOG) == -1) {
-      printf("start server error\n");
+      log_error("start server error");
       exit(1);
    }
    
-   printf("Server Launched! Listening on PORT: %d\n", PORT);
+   // Join the federation (after the Lobby exists so it is announced)
+   if (config.relay_path) {
+      if (fed_start(config.relay_path) != 0) {
+         log_error("Error connecting to relay at %s", config.relay_path);
+         exit(1);
+      }
+      log_info("Federated through relay %s", config.relay_path);
+   }
+
+   if (config.metrics_path) {
+      if (stats_start_endpoint(config.metrics_path) != 0) {
+         log_error("Error opening metrics socket %s", config.metrics_path);
+         exit(1);
+      }
+      log_info("Metrics on %s", config.metrics_path);
+   }
+
+   log_info("Server Launched! Listening on PORT: %d", config.port);
     
+   if (config.shards > 0) {
+      if (config.shards > MAX_SHARDS || shard_start(config.shards) != 0) {
+         log_error("Error starting %d shards (max %d)", config.shards, MAX_SHARDS);
+         exit(1);
+      }
+      log_info("Sharded mode: %d workers", config.shards);
+   }
+
+   // Watch for overload (needs the wheel, and the shards for queue depth)
+   if (config.overload.max_clients == 0) {
+      config.overload.max_clients = config.max_users;
+   }
+   if (config.shards > 0) {
+      config.overload.queue_depth = shard_queue_depth;
+   }
+   overload_start(&config.overload);
+
    //Main execution loop
    while(1) {
-      //Accept a connection, start a thread
+      //Accept a connection, hand it to a shard or start a thread
       int new_client = accept_client(chat_serv_sock_fd);
-      if(new_client != -1) {
+      if(new_client == -1) {
+         continue;
+      }
+      if (!overload_admit()) {
+         refuse_client(new_client);
+         continue;
+      }
+      if (config.shards > 0) {
+         shard_assign(new_client);
+      } else {
          pthread_t new_client_thread;
-         pthread_create(&new_client_thread, NULL, client_receive, (void *)&new_client);
+         if (pthread_create(&new_client_thread, NULL, client_receive, (void *)(intptr_t)new_client) != 0) {
+            client_close(NULL, new_client);    // gives the slot back
+            continue;
+         }
          pthread_detach(new_client_thread);
       }
    }
@@ -60,25 +262,32 @@ int get_server_socket(void) {
     
     //create a master socket  
     if( (master_socket = socket(AF_INET , SOCK_STREAM , 0)) == 0) {   
-        perror("socket failed");   
+        log_error("socket failed: %s", strerror(errno));   
         exit(EXIT_FAILURE);   
     }   
      
     //set master socket to allow multiple connections  
     if( setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt,  
           sizeof(opt)) < 0 ) {   
-        perror("setsockopt");   
+        log_error("setsockopt: %s", strerror(errno));   
         exit(EXIT_FAILURE);   
     }   
+
+    //federated servers may share one port as a SO_REUSEPORT group
+    if (config.relay_path &&
+        setsockopt(master_socket, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(opt)) < 0) {
+        log_error("setsockopt SO_REUSEPORT: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
      
     //type of socket created  
     address.sin_family = AF_INET;   
     address.sin_addr.s_addr = INADDR_ANY;   
-    address.sin_port = htons(PORT);   
+    address.sin_port = htons(config.port);   
          
-    //bind the socket to localhost port 8888  
+    //bind the socket to localhost port (8888 by default)  
     if (bind(master_socket, (struct sockaddr *)&address, sizeof(address))<0) {   
-        perror("bind failed");   
+        log_error("bind failed: %s", strerror(errno));   
         exit(EXIT_FAILURE);   
     }   
 
@@ -88,7 +297,7 @@ int get_server_socket(void) {
 int start_server(int serv_socket, int backlog) {
    int status = 0;
    if ((status = listen(serv_socket, backlog)) == -1) {
-      printf("socket listen error\n");
+      log_error("socket listen error: %s", strerror(errno));
    }
    return status;
 }
@@ -99,7 +308,7 @@ int accept_client(int serv_sock) {
    struct sockaddr_storage client_addr;
 
    if ((reply_sock_fd = accept(serv_sock,(struct sockaddr *)&client_addr, &sin_size)) == -1) {
-      printf("socket accept error\n");
+      log_warn("socket accept error: %s", strerror(errno));
    }
    return reply_sock_fd;
 }
@@ -107,13 +316,25 @@ int accept_client(int serv_sock) {
 /* Handle SIGINT (CTRL+C) */
 void sigintHandler(int sig_num) {
     (void)sig_num;  // unused
-    printf("\n[Server] Caught SIGINT. Shutting down...\n");
+    log_info("[Server] Caught SIGINT. Shutting down...");
+    log_info("--------CLOSING ACTIVE USERS--------");
 
-    printf("--------CLOSING ACTIVE USERS--------\n");
+    // Write out the trace before tearing anything down
+    if (config.trace_path) {
+        long n = trace_dump(config.trace_path);
+        log_info("Wrote %ld trace events to %s", n, config.trace_path);
+    }
 
     // Use our centralized cleanup (closes all user sockets, frees rooms/users)
     cleanup_all();
 
+    // Report how often the rate limits fired
+    char rlbuf[256];
+    ratelimit_report(rlbuf, sizeof(rlbuf));
+    for (char *line = strtok(rlbuf, "\n"); line; line = strtok(NULL, "\n")) {
+        log_info("%s", line);
+    }
+
     // Destroy locks
     pthread_mutex_destroy(&rw_lock);
     pthread_mutex_destroy(&mutex);
@@ -121,6 +342,6 @@ void sigintHandler(int sig_num) {
     // Close the listening socket
     close(chat_serv_sock_fd);
 
-    printf("[Server] Shutdown complete. Bye.\n");
-    exit(0);
+    log_info("[Server] Shutdown complete. Bye.");
+    exit(0);    // drains the log at exit
 }
\ No newline at end of file
@@ -17,19 +17,59 @@
 #include <netdb.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <stdint.h>
 
 /* Local Header Files */
 #include "list.h"
+#include "wheel.h"
+#include "overload.h"
 
 #define MAX_READERS 25
 #define TRUE   1  
 #define FALSE  0  
 #define PORT 8888  
 #define delimiters " "
-#define max_clients  30
 #define DEFAULT_ROOM "Lobby"
 #define MAXBUFF   2096
 #define BACKLOG 2 
+#define STATS_TEXT_MAX 65536   // largest stats reply
+#define TRACE_DIR "traces"     // where "trace dump <name>" writes
+
+/* Rate limit defaults (per user, tokens/sec and burst size) */
+#define DEFAULT_CHAT_RATE   20
+#define DEFAULT_CHAT_BURST  40
+#define DEFAULT_CMD_RATE    5
+#define DEFAULT_CMD_BURST   10
+#define DEFAULT_MAX_DELAY_MS 250   // longest we will stall input before dropping it
+
+/* Arena sizes (users include federated proxies) */
+#define DEFAULT_MAX_USERS   65536
+#define DEFAULT_MAX_ROOMS   4096
+
+/* Keepalive: grace after a ping before a silent client is dropped */
+#define DEFAULT_REAP_S      30
+
+/* Runtime configuration (set from the command line in main) */
+struct server_config {
+    double chat_rate;      // 0 = unlimited
+    double chat_burst;
+    double cmd_rate;       // 0 = unlimited
+    double cmd_burst;
+    int    max_delay_ms;
+    int    port;
+    const char *relay_path; // NULL = standalone, else federate over this relay
+    int    shards;         // 0 = thread per client, else number of event-loop shards
+    const char *metrics_path; // Unix socket serving stats text (NULL = off)
+    const char *trace_path;   // trace from startup and dump here on exit (NULL = off)
+    bool   single;         // one room and one DM per user (-s)
+    int    max_users;      // user arena slots
+    int    max_rooms;      // room arena slots
+    int    ping_s;         // ping after this much silence (0 = no keepalive)
+    int    reap_s;         // then disconnect after this much more
+    struct overload_config overload; // limits, actions and max clients (0 = max users)
+};
+
+extern struct server_config config;
 
 /* global MOTD */
 extern const char *server_MOTD;
@@ -41,5 +81,11 @@ int start_server(int serv_socket, int backlog);
 int accept_client(int serv_sock);
 void sigintHandler(int sig_num);
 void *client_receive(void *ptr);
+user_t *client_open(int client);
+int  client_handle(user_t *me, int client, char *buffer, int received);
+void client_close(user_t *me, int client);
+void broadcast_message(user_t *sender, const char *text);
+int  audience_class(user_t *sender, user_t *u, int *batch_ms);
+bool deliver_direct(user_t *sender, const char *to, const char *text);
 
 #endif
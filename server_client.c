@@ -1,4 +1,12 @@
 #include "server.h"
+#include "fed.h"
+#include "shard.h"
+#include "stats.h"
+#include "clock.h"
+#include "trace.h"
+#include "presence.h"
+#include "log.h"
+#include "stream.h"
 
 /* USE THESE LOCKS AND COUNTER TO SYNCHRONIZE (managed inside list.c) */
 
@@ -12,41 +20,59 @@ extern const char *server_MOTD;
 struct send_ctx {
     user_t *sender;
     char message[MAXBUFF];
+    size_t line_len;            // length of message without the trailing prompt
+    int recipients;             // for the fan-out histogram
 };
 
-/* Helper to trim whitespace (unchanged) */
-char *trimwhitespace(char *str)
-{
-  char *end;
-
-  while(isspace((unsigned char)*str)) str++;
-
-  if(*str == 0)
-    return str;
-
-  end = str + strlen(str) - 1;
-  while(end > str && isspace((unsigned char)*end)) end--;
-
-  end[1] = '\0';
-  return str;
+/*
+ * Send a reply to our own client ahead of queued room chat. Before the
+ * user exists (or if creating it failed) it goes straight to the socket.
+ */
+static void send_ctrl(user_t *me, int client, const char *buf, size_t len) {
+    if (me) outq_send(&me->out, OUT_CTRL, buf, len);
+    else counted_send(client, buf, len);
 }
 
-/* Callback used by for_each_user to send a message to appropriate recipients */
-static void send_message_cb(user_t *u, void *ctx_void) {
-    struct send_ctx *ctx = (struct send_ctx *)ctx_void;
-    user_t *sender = ctx->sender;
-
-    if (!u || !sender) return;
-    if (u == sender) return; // don't send to self
+/*
+ * Charge one token from the given bucket. Over-limit input is delayed
+ * briefly; if it would have to wait too long it is dropped here, before
+ * it reaches the command or fan-out path. Returns true if dropped.
+ */
+static bool rate_limited(user_t *me, token_bucket_t *b, rl_class_t cls) {
+    // A shard serves many clients, so it never sleeps on one of them
+    int max_delay = (config.shards > 0) ? 0 : config.max_delay_ms;
+    if (bucket_take(b, cls, max_delay) != RL_DROPPED)
+        return false;
+
+    const char *msg = (cls == RL_CHAT)
+        ? "Rate limit exceeded, message dropped\nchat>"
+        : "Rate limit exceeded, command dropped\nchat>";
+    outq_send(&me->out, OUT_CTRL, msg, strlen(msg));
+    return true;
+}
 
-    // Check: share a room?
+/*
+ * How u hears chat from sender: OUT_CTRL over a DM, OUT_CHAT through a
+ * shared unbatched room, else -1. If u is only reachable through batched
+ * rooms, *batch_ms is set to the shortest of their windows. Caller holds
+ * the read lock.
+ */
+int audience_class(user_t *sender, user_t *u, int *batch_ms) {
+    // Check: share a room? Rooms with a batching window are tracked
+    // separately; the shortest shared window wins.
     bool shared_room = false;
+    *batch_ms = 0;
     room_list_t *sr = sender->rooms;
     while (sr && !shared_room) {
         room_list_t *ur = u->rooms;
         while (ur) {
             if (ur->room == sr->room) {
-                shared_room = true;
+                int w = room_batch_ms(sr->room);
+                if (w == 0) {
+                    shared_room = true;
+                } else if (*batch_ms == 0 || w < *batch_ms) {
+                    *batch_ms = w;
+                }
                 break;
             }
             ur = ur->next;
@@ -65,236 +91,903 @@ static void send_message_cb(user_t *u, void *ctx_void) {
         dl = dl->next;
     }
 
-    if (shared_room || dm) {
-        send(u->socket, ctx->message, strlen(ctx->message), 0);
+    // DMs jump ahead of room chat already queued for u
+    if (dm) return OUT_CTRL;
+    return shared_room ? OUT_CHAT : -1;
+}
+
+/* Callback used by for_each_user to send a message to appropriate recipients */
+static void send_message_cb(user_t *u, void *ctx_void) {
+    struct send_ctx *ctx = (struct send_ctx *)ctx_void;
+    user_t *sender = ctx->sender;
+
+    if (!u || !sender) return;
+    if (u == sender) return; // don't send to self
+    if (u->node != 0) return; // remote users are served by their own node
+
+    int batch_ms;
+    int cls = audience_class(sender, u, &batch_ms);
+    if (cls >= 0) {
+        outq_send(&u->out, cls, ctx->message, strlen(ctx->message));
+        ctx->recipients++;
+    } else if (batch_ms > 0) {
+        // Only reachable through batched rooms: merge into the next flush
+        batch_enqueue(&u->batch, ctx->message, ctx->line_len, batch_ms);
+        ctx->recipients++;
     }
 }
 
 /*
- * Main thread for each client. Receives all messages,
- * and passes the data off to the correct function.
+ * Single-membership fan-out callback: u is in sender's one room or is
+ * its DM target, so there is nothing left to check but batching.
  */
-void *client_receive(void *ptr) {
-   int client = *(int *) ptr;  // socket
-  
-   int received, i;
-   char buffer[MAXBUFF], sbuffer[MAXBUFF];  
-   char tmpbuf[MAXBUFF];     
-   char cmd[MAXBUFF], username[20];
-   char *arguments[80];
+static void send_single_cb(user_t *u, bool dm, void *ctx_void) {
+    struct send_ctx *ctx = (struct send_ctx *)ctx_void;
+    if (u->node != 0) return; // remote users are served by their own node
+
+    int batch_ms = dm ? 0 : room_batch_ms(ctx->sender->room);
+    if (batch_ms == 0) {
+        outq_send(&u->out, dm ? OUT_CTRL : OUT_CHAT, ctx->message, strlen(ctx->message));
+    } else {
+        batch_enqueue(&u->batch, ctx->message, ctx->line_len, batch_ms);
+    }
+    ctx->recipients++;
+}
+
+/*
+ * Deliver a chat line from sender to everyone sharing a room with them
+ * or DM-connected from them. Sender may be a federated proxy user.
+ */
+void broadcast_message(user_t *sender, const char *text) {
+    struct send_ctx ctx;
+    ctx.sender = sender;
+    snprintf(ctx.message, MAXBUFF, "\n::%s> %s\nchat>",
+             sender ? sender->username : "unknown", text);
+    ctx.line_len = strlen(ctx.message) - strlen("chat>");
+    ctx.recipients = 0;
+
+    uint64_t t0 = now_ns();
+    if (single_membership) {
+        for_each_audience(sender, send_single_cb, &ctx);
+    } else {
+        for_each_user(send_message_cb, &ctx);
+    }
+
+    atomic_fetch_add(&stats.messages, 1);
+    hist_record(&stats.fanout_ns, now_ns() - t0);
+    hist_record(&stats.fanout_recipients, ctx.recipients);
+    TRACE_SPAN(TR_FANOUT, t0, ctx.recipients);
+}
+
+/* Callback for deliver_direct, run under the read lock */
+struct direct_ctx {
+    user_t *sender;
+    const char *text;
+    bool remote;                // target lives on another node
+};
+
+static void send_direct_cb(user_t *u, void *ctx_void) {
+    struct direct_ctx *ctx = ctx_void;
+    if (u->node != 0) {
+        ctx->remote = true;
+        return;
+    }
+    char message[MAXBUFF];
+    int n = snprintf(message, MAXBUFF, "\n::%s> %s\nchat>", ctx->sender->username, ctx->text);
+    if (n >= MAXBUFF) n = MAXBUFF - 1;
+    outq_send(&u->out, OUT_CTRL, message, n);
+}
+
+/*
+ * Deliver a line from sender to the one user named `to`: a hashed name
+ * lookup and one queue, with no fan-out scan. A target on another node
+ * is forwarded over federation when sender is local. Returns false if
+ * there is no such user.
+ */
+bool deliver_direct(user_t *sender, const char *to, const char *text) {
+    struct direct_ctx ctx = { .sender = sender, .text = text };
+
+    if (!with_user_by_name(to, send_direct_cb, &ctx)) {
+        return false;
+    }
+    if (ctx.remote && sender->node == 0) {
+        fed_publish_msg(sender->username, to, text);
+    }
+    atomic_fetch_add(&stats.direct_messages, 1);
+    return true;
+}
+
+/* Admin commands are only accepted from the local machine */
+static bool is_admin(int client) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(client, (struct sockaddr *)&addr, &len) < 0) return false;
+
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+        return IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr);
+    }
+    return addr.ss_family == AF_UNIX;
+}
+
+/* ========== Keepalive ========== */
+
+/*
+ * Wheel callback for a silent client. Input only stamps last_active_ns,
+ * so the timer is re-armed lazily here for whatever is left. After
+ * ping_s of silence we send a ping; reap_s later we shut the socket down,
+ * and the thread or shard that owns it sees EOF and runs client_close.
+ */
+static void idle_due(wheel_timer_t *t, void *arg) {
+    user_t *u = arg;
+    uint64_t ping_ns = (uint64_t)config.ping_s * 1000000000ull;
+    uint64_t reap_ns = ping_ns + (uint64_t)config.reap_s * 1000000000ull;
+    uint64_t idle = now_ns() - atomic_load_explicit(&u->last_active_ns, memory_order_relaxed);
+
+    if (idle >= reap_ns) {
+        atomic_fetch_add(&stats.conns_reaped, 1);
+        shutdown(u->socket, SHUT_RDWR);
+        return;
+    }
+    if (idle >= ping_ns) {
+        const char *ping = "\n@ping\nchat>";
+        outq_send(&u->out, OUT_CTRL, ping, strlen(ping));
+        atomic_fetch_add(&stats.pings, 1);
+        wheel_arm(t, (reap_ns - idle) / 1000000 + 1);
+        return;
+    }
+    wheel_arm(t, (ping_ns - idle) / 1000000 + 1);
+}
+
+/*
+ * Set up a newly accepted client: guest user in the Lobby, rate limits,
+ * federation announcement and the MOTD. The connection already holds a
+ * slot from overload_admit. Returns the new user, or NULL (with the
+ * socket closed and the slot given back) when the user arena is full.
+ */
+user_t *client_open(int client) {
+   char username[20];
 
    // Create guest user and add to Lobby
    sprintf(username,"guest%d", client);
    user_t *me = create_user(client, username);
+   if (!me) {
+       const char *full = "Server full, try again later\n";
+       counted_send(client, full, strlen(full));
+       client_close(NULL, client);
+       return NULL;
+   }
    room_t *lobby = create_room(DEFAULT_ROOM);
-   if (me && lobby) {
+   if (lobby) {
        user_join_room(me, lobby);
    }
+   bucket_init(&me->chat_bucket, config.chat_rate, config.chat_burst);
+   bucket_init(&me->cmd_bucket, config.cmd_rate, config.cmd_burst);
+   fed_publish_user(me);
+
+   atomic_store(&me->last_active_ns, now_ns());
+   wheel_timer_init(&me->idle, idle_due, me);
+   if (config.ping_s > 0) {
+       wheel_arm(&me->idle, (uint64_t)config.ping_s * 1000);
+   }
+
+   atomic_fetch_add(&stats.conns_total, 1);
+   log_debug("%s connected (fd %d)", username, client);
 
    // Send MOTD
-   send(client, server_MOTD, strlen(server_MOTD), 0);
+   send_ctrl(me, client, server_MOTD, strlen(server_MOTD));
+   return me;
+}
 
-   while (1) {
-      received = read(client , buffer, MAXBUFF);
+/* Tear down a client: drop the user everywhere and close its socket */
+void client_close(user_t *me, int client) {
+   atomic_fetch_sub(&stats.conns_active, 1);
+   if (me) {
+       log_debug("%s disconnected (fd %d)", me->username, client);
+       wheel_cancel(&me->idle);     // the callback must not outlive the user
+       stream_abort(me);
+       presence_unsubscribe(me);
+       fed_publish(FED_USER_DEL, me->username, NULL);
+       remove_user(me);    // also closes the socket
+   } else {
+       close(client);
+   }
+}
 
-      if (received <= 0) {
-          // client disconnected
-          if (me) {
-              remove_user(me);
-          }
-          close(client);
-          break;
-      }
+/* ========== Commands ========== */
 
-      buffer[received] = '\0'; 
-      strcpy(cmd, buffer);  
-      strcpy(sbuffer, buffer);
+/*
+ * State for one command. argv points into the receive buffer (split
+ * in place), so replies are built in the separate reply buffer.
+ */
+struct cmd_ctx {
+    user_t *me;
+    int     client;
+    char  **argv;
+    int     argc;
+    char   *end;                    // end of the input line (its NUL)
+    char   *rest;                   // input after a paste's header; its leftover is the next input
+    size_t  rest_len;
+    char   *reply;                  // MAXBUFF long
+    bool    membership_changed;     // shards re-read our rooms/DMs
+};
 
-      /////////////////////////////////////////////////////
-      // Tokenize the input in buffer
-      arguments[0] = strtok(cmd, delimiters);
+typedef int (*cmd_handler_t)(struct cmd_ctx *c);
 
-      i = 0;
-      while (arguments[i] != NULL) {
-          arguments[++i] = strtok(NULL, delimiters);
-          if (arguments[i-1]) {
-              arguments[i-1] = trimwhitespace(arguments[i-1]);
-          }
-      }
+static void reply(struct cmd_ctx *c) {
+    send_ctrl(c->me, c->client, c->reply, strlen(c->reply));
+}
 
-      if (arguments[0] == NULL) {
-          sprintf(buffer, "\nchat>");
-          send(client , buffer , strlen(buffer) , 0 );
-          continue;
-      }
+/* ========== Name lists (join a,b,c / leave a,b,c / connect u1,u2) ========== */
 
-      // Arg[0] = command
-      // Arg[1] = user or room (if present)
-
-      /////////////////////////////////////////////////////
-      // Commands
-
-      if(strcmp(arguments[0], "create") == 0)
-      {
-           if (!arguments[1]) {
-               sprintf(buffer, "Usage: create <room>\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else {
-               room_t *r = create_room(arguments[1]);
-               if (r && me) {
-                   user_join_room(me, r);
-                   snprintf(buffer, MAXBUFF, "Created and joined room '%s'\nchat>", arguments[1]);
-               } else {
-                   snprintf(buffer, MAXBUFF, "Error creating room '%s'\nchat>", arguments[1]);
-               }
-               send(client, buffer, strlen(buffer), 0);
-           }
-      }
-      else if (strcmp(arguments[0], "join") == 0)
-      {
-           if (!arguments[1]) {
-               sprintf(buffer, "Usage: join <room>\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else {
-               room_t *r = create_room(arguments[1]); // idempotent
-               if (r && me) {
-                   user_join_room(me, r);
-                   snprintf(buffer, MAXBUFF, "Joined room '%s'\nchat>", arguments[1]);
-               } else {
-                   snprintf(buffer, MAXBUFF, "Error joining room '%s'\nchat>", arguments[1]);
-               }
-               send(client, buffer, strlen(buffer), 0);
-           }
-      }
-      else if (strcmp(arguments[0], "leave") == 0)
-      {
-           if (!arguments[1]) {
-               sprintf(buffer, "Usage: leave <room>\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else {
-               room_t *r = find_room(arguments[1]);
-               if (r && me) {
-                   user_leave_room(me, r);
-                   snprintf(buffer, MAXBUFF, "Left room '%s'\nchat>", arguments[1]);
-               } else {
-                   snprintf(buffer, MAXBUFF, "Room '%s' does not exist\nchat>", arguments[1]);
-               }
-               send(client, buffer, strlen(buffer), 0);
-           }
-      } 
-      else if (strcmp(arguments[0], "connect") == 0)
-      {
-           if (!arguments[1]) {
-               sprintf(buffer, "Usage: connect <user>\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else if (!me) {
-               sprintf(buffer, "Error: user not initialized\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else {
-               user_t *other = find_user_by_name(arguments[1]);
-               if (other) {
-                   user_connect_dm(me, other);   // one-way DM from me -> other
-                   snprintf(buffer, MAXBUFF, "Connected (DM) to user '%s'\nchat>", arguments[1]);
-               } else {
-                   snprintf(buffer, MAXBUFF, "User '%s' not found\nchat>", arguments[1]);
-               }
-               send(client, buffer, strlen(buffer), 0);
-           }
+/* Split argv[1] into names; 0 for an empty list, -1 (reply set) if too long */
+static int split_names(struct cmd_ctx *c, char **names) {
+    int n = cmd_split_list(c->argv[1], names, LIST_BATCH_MAX);
+    if (n < 0) {
+        snprintf(c->reply, MAXBUFF, "Too many names (max %d)\nchat>", LIST_BATCH_MAX);
+    }
+    return n;
+}
+
+#define RES(r) (1u << (r))
+
+/*
+ * Append "label: a, b\n" for the names whose result is in the `want`
+ * mask; nothing if none match. Whatever does not fit is cut off, always
+ * leaving room for the prompt.
+ */
+static void reply_names(struct cmd_ctx *c, size_t *off, const char *label, char **names,
+                        const list_result_t *res, int n, unsigned want) {
+    const size_t cap = MAXBUFF - sizeof("chat>");
+    bool first = true;
+    for (int i = 0; i < n; i++) {
+        if (!(want & RES(res[i]))) continue;
+        if (*off < cap) {
+            *off += snprintf(c->reply + *off, cap - *off, "%s%s", first ? label : ", ", names[i]);
+        }
+        first = false;
+    }
+    if (!first && *off < cap) *off += snprintf(c->reply + *off, cap - *off, "\n");
+    if (*off >= cap) *off = cap - 1;
+}
+
+/* One write lock for the whole list, then one reply */
+static void join_list(struct cmd_ctx *c) {
+    char *names[LIST_BATCH_MAX];
+    list_result_t res[LIST_BATCH_MAX];
+    int n = split_names(c, names);
+    if (n < 0) return;
+
+    if (n == 0) {
+        sprintf(c->reply, "Usage: join <room>[,<room>...]\nchat>");
+        return;
+    }
+    if (single_membership) {
+        sprintf(c->reply, "Only one room at a time in single-membership mode\nchat>");
+        return;
+    }
+    user_join_rooms(c->me, names, n, res);
+
+    for (int i = 0; i < n; i++) {
+        if (res[i] == LIST_CREATED) fed_publish(FED_ROOM_ADD, names[i], NULL);
+        if (res[i] == LIST_CREATED || res[i] == LIST_DONE) {
+            fed_publish(FED_JOIN, c->me->username, names[i]);
+        }
+    }
+    c->membership_changed = true;
+
+    size_t off = 0;
+    reply_names(c, &off, "Joined rooms: ", names, res, n,
+                RES(LIST_DONE) | RES(LIST_CREATED) | RES(LIST_UNCHANGED));
+    reply_names(c, &off, "Error joining rooms: ", names, res, n, RES(LIST_FAILED));
+    strcpy(c->reply + off, "chat>");
+}
+
+static void leave_list(struct cmd_ctx *c) {
+    char *names[LIST_BATCH_MAX];
+    list_result_t res[LIST_BATCH_MAX];
+    int n = split_names(c, names);
+    if (n < 0) return;
+
+    if (n == 0) {
+        sprintf(c->reply, "Usage: leave <room>[,<room>...]\nchat>");
+        return;
+    }
+    user_leave_rooms(c->me, names, n, res);
+
+    for (int i = 0; i < n; i++) {
+        if (res[i] == LIST_DONE) fed_publish(FED_LEAVE, c->me->username, names[i]);
+    }
+    c->membership_changed = true;
+
+    size_t off = 0;
+    reply_names(c, &off, "Left rooms: ", names, res, n, RES(LIST_DONE) | RES(LIST_UNCHANGED));
+    reply_names(c, &off, "Rooms not found: ", names, res, n, RES(LIST_MISSING));
+    strcpy(c->reply + off, "chat>");
+}
+
+static void connect_list(struct cmd_ctx *c) {
+    char *names[LIST_BATCH_MAX];
+    list_result_t res[LIST_BATCH_MAX];
+    int n = split_names(c, names);
+    if (n < 0) return;
+
+    if (n == 0) {
+        sprintf(c->reply, "Usage: connect <user>[,<user>...]\nchat>");
+        return;
+    }
+    if (single_membership) {
+        sprintf(c->reply, "Only one DM at a time in single-membership mode\nchat>");
+        return;
+    }
+    user_connect_dms(c->me, names, n, res);
+
+    for (int i = 0; i < n; i++) {
+        if (res[i] == LIST_DONE) fed_publish(FED_DM_ADD, c->me->username, names[i]);
+    }
+    c->membership_changed = true;
+
+    size_t off = 0;
+    reply_names(c, &off, "Connected (DM) to users: ", names, res, n,
+                RES(LIST_DONE) | RES(LIST_UNCHANGED));
+    reply_names(c, &off, "Users not found: ", names, res, n, RES(LIST_MISSING));
+    strcpy(c->reply + off, "chat>");
+}
+
+static int cmd_create(struct cmd_ctx *c) {
+    if (c->me && rate_limited(c->me, &c->me->cmd_bucket, RL_CMD)) {
+        return 0;   // dropped
+    }
+    if (!c->argv[1]) {
+        sprintf(c->reply, "Usage: create <room>\nchat>");
+    } else {
+        room_t *r = create_room(c->argv[1]);
+        if (r && c->me) {
+            user_join_room(c->me, r);
+            fed_publish(FED_ROOM_ADD, r->name, NULL);
+            fed_publish(FED_JOIN, c->me->username, r->name);
+            c->membership_changed = true;
+            snprintf(c->reply, MAXBUFF, "Created and joined room '%s'\nchat>", c->argv[1]);
+        } else {
+            snprintf(c->reply, MAXBUFF, "Error creating room '%s'\nchat>", c->argv[1]);
+        }
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_join(struct cmd_ctx *c) {
+    if (c->me && rate_limited(c->me, &c->me->cmd_bucket, RL_CMD)) {
+        return 0;   // dropped
+    }
+    if (!c->argv[1]) {
+        sprintf(c->reply, "Usage: join <room>[,<room>...]\nchat>");
+    } else if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+    } else if (strchr(c->argv[1], ',')) {
+        join_list(c);
+    } else {
+        room_t *r = create_room(c->argv[1]); // idempotent
+        if (r && c->me) {
+            user_join_room(c->me, r);
+            fed_publish(FED_JOIN, c->me->username, r->name);
+            c->membership_changed = true;
+            snprintf(c->reply, MAXBUFF, "Joined room '%s'\nchat>", c->argv[1]);
+        } else {
+            snprintf(c->reply, MAXBUFF, "Error joining room '%s'\nchat>", c->argv[1]);
+        }
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_leave(struct cmd_ctx *c) {
+    if (!c->argv[1]) {
+        sprintf(c->reply, "Usage: leave <room>[,<room>...]\nchat>");
+    } else if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+    } else if (strchr(c->argv[1], ',')) {
+        leave_list(c);
+    } else {
+        room_t *r = find_room(c->argv[1]);
+        if (r && c->me) {
+            user_leave_room(c->me, r);
+            fed_publish(FED_LEAVE, c->me->username, r->name);
+            c->membership_changed = true;
+            snprintf(c->reply, MAXBUFF, "Left room '%s'\nchat>", c->argv[1]);
+        } else {
+            snprintf(c->reply, MAXBUFF, "Room '%s' does not exist\nchat>", c->argv[1]);
+        }
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_connect(struct cmd_ctx *c) {
+    if (!c->argv[1]) {
+        sprintf(c->reply, "Usage: connect <user>[,<user>...]\nchat>");
+    } else if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+    } else if (strchr(c->argv[1], ',')) {
+        connect_list(c);
+    } else {
+        /* Resolved and linked under one write lock, so the peer cannot go away in between */
+        list_result_t res;
+        user_connect_dms(c->me, &c->argv[1], 1, &res);   // one-way DM from me -> other
+        if (res == LIST_MISSING) {
+            snprintf(c->reply, MAXBUFF, "User '%s' not found\nchat>", c->argv[1]);
+        } else {
+            if (res == LIST_DONE) fed_publish(FED_DM_ADD, c->me->username, c->argv[1]);
+            c->membership_changed = true;
+            snprintf(c->reply, MAXBUFF, "Connected (DM) to user '%s'\nchat>", c->argv[1]);
+        }
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_disconnect(struct cmd_ctx *c) {
+    if (!c->argv[1]) {
+        sprintf(c->reply, "Usage: disconnect <user>\nchat>");
+    } else if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+    } else {
+        list_result_t res;
+        user_disconnect_dms(c->me, &c->argv[1], 1, &res);
+        if (res == LIST_MISSING) {
+            snprintf(c->reply, MAXBUFF, "User '%s' not found\nchat>", c->argv[1]);
+        } else {
+            if (res == LIST_DONE) fed_publish(FED_DM_DEL, c->me->username, c->argv[1]);
+            c->membership_changed = true;
+            snprintf(c->reply, MAXBUFF, "Disconnected DM from user '%s'\nchat>", c->argv[1]);
+        }
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_batch(struct cmd_ctx *c) {
+    if (c->me && rate_limited(c->me, &c->me->cmd_bucket, RL_CMD)) {
+        return 0;   // dropped
+    }
+    /* A window delays every member of the room, so only admins set it */
+    if (!is_admin(c->client)) {
+        sprintf(c->reply, "batch: admin only (connect from localhost)\nchat>");
+    } else if (!c->argv[1] || !c->argv[2]) {
+        sprintf(c->reply, "Usage: batch <room> <ms>\nchat>");
+    } else {
+        room_t *r = find_room(c->argv[1]);
+        int window = atoi(c->argv[2]);
+        if (!r) {
+            snprintf(c->reply, MAXBUFF, "Room '%s' does not exist\nchat>", c->argv[1]);
+        } else if (window <= 0) {
+            room_set_batch(r, 0);
+            snprintf(c->reply, MAXBUFF, "Batching disabled for room '%s'\nchat>", c->argv[1]);
+        } else {
+            room_set_batch(r, window);
+            snprintf(c->reply, MAXBUFF, "Batching room '%s' every %d ms\nchat>",
+                     c->argv[1], room_batch_ms(r));
+        }
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_stats(struct cmd_ctx *c) {
+    if (!is_admin(c->client)) {
+        sprintf(c->reply, "stats: admin only (connect from localhost)\nchat>");
+        reply(c);
+        return 0;
+    }
+    char *text = malloc(STATS_TEXT_MAX);
+    if (text) {
+        size_t n = stats_format(text, STATS_TEXT_MAX - 8);
+        strcpy(text + n, "chat>");
+        send_ctrl(c->me, c->client, text, n + strlen("chat>"));
+        free(text);
+    }
+    return 0;
+}
+
+/*
+ * "trace dump" writes to the -t file; "trace dump <name>" to a file in
+ * TRACE_DIR. Clients never pick the path: names with '/' or ".." are
+ * refused.
+ */
+static void trace_dump_to(struct cmd_ctx *c, const char *name) {
+    char path[256];
+    if (!name) {
+        if (!config.trace_path) {
+            sprintf(c->reply, "Usage: trace dump <name> (no -t file to write to)\nchat>");
+            return;
+        }
+        snprintf(path, sizeof(path), "%s", config.trace_path);
+    } else if (!*name || strchr(name, '/') || strstr(name, "..") ||
+               strlen(name) > sizeof(path) - sizeof(TRACE_DIR) - 1) {
+        snprintf(c->reply, MAXBUFF, "Bad trace name '%.64s': a plain file name only\nchat>", name);
+        return;
+    } else {
+        mkdir(TRACE_DIR, 0755);     // fails harmlessly if it exists
+        snprintf(path, sizeof(path), "%s/%s", TRACE_DIR, name);
+    }
+
+    long n = trace_dump(path);
+    if (n < 0) {
+        snprintf(c->reply, MAXBUFF, "Error writing trace to '%.200s'\nchat>", path);
+    } else {
+        snprintf(c->reply, MAXBUFF, "Wrote %ld trace events to '%.200s'\nchat>", n, path);
+    }
+}
+
+static int cmd_trace(struct cmd_ctx *c) {
+    const char *sub = c->argv[1];
+    if (!is_admin(c->client)) {
+        sprintf(c->reply, "trace: admin only (connect from localhost)\nchat>");
+    } else if (sub && strcmp(sub, "on") == 0) {
+        trace_set(true);
+        sprintf(c->reply, "Tracing on\nchat>");
+    } else if (sub && strcmp(sub, "off") == 0) {
+        trace_set(false);
+        sprintf(c->reply, "Tracing off\nchat>");
+    } else if (sub && strcmp(sub, "dump") == 0) {
+        trace_dump_to(c, c->argv[2]);
+    } else {
+        sprintf(c->reply, "Usage: trace on|off|dump [name]\nchat>");
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_log(struct cmd_ctx *c) {
+    const char *lvl = c->argv[1];
+    if (!is_admin(c->client)) {
+        sprintf(c->reply, "log: admin only (connect from localhost)\nchat>");
+    } else if (!lvl) {
+        snprintf(c->reply, MAXBUFF, "Log level is %s\nchat>",
+                 log_level_name(atomic_load(&log_level)));
+    } else if (log_level_parse(lvl) < 0) {
+        sprintf(c->reply, "Usage: log [debug|info|warn|error]\nchat>");
+    } else {
+        log_set_level(log_level_parse(lvl));
+        snprintf(c->reply, MAXBUFF, "Log level set to %s\nchat>", lvl);
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_rooms(struct cmd_ctx *c) {
+    log_debug("%s: list rooms", c->me ? c->me->username : "?");
+
+    char listbuf[MAXBUFF - 16];    // leaves room for the heading and prompt
+    list_all_rooms(listbuf, sizeof(listbuf));
+
+    snprintf(c->reply, MAXBUFF, "Rooms:\n%s\nchat>", listbuf);
+    reply(c);
+    return 0;
+}
+
+static int cmd_users(struct cmd_ctx *c) {
+    log_debug("%s: list users", c->me ? c->me->username : "?");
+
+    char listbuf[MAXBUFF - 16];    // leaves room for the heading and prompt
+    list_all_users(listbuf, sizeof(listbuf));
+
+    snprintf(c->reply, MAXBUFF, "Users:\n%s\nchat>", listbuf);
+    reply(c);
+    return 0;
+}
+
+static int cmd_login(struct cmd_ctx *c) {
+    if (c->me && rate_limited(c->me, &c->me->cmd_bucket, RL_CMD)) {
+        return 0;   // dropped
+    }
+    if (!c->argv[1]) {
+        sprintf(c->reply, "Usage: login <username>\nchat>");
+    } else if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+    } else {
+        char oldname[MAX_NAME];
+        strcpy(oldname, c->me->username);
+        user_rename(c->me, c->argv[1]);
+        fed_publish(FED_RENAME, oldname, c->me->username);
+        snprintf(c->reply, MAXBUFF, "Logged in as '%s'\nchat>", c->argv[1]);
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_help(struct cmd_ctx *c) {
+    sprintf(c->reply,
+        "login <username> - \"login with username\" \n"
+        "create <room>   - \"create a room\" \n"
+        "join <room>[,<room>...] - \"join rooms\" \n"
+        "leave <room>[,<room>...] - \"leave rooms\" \n"
+        "users           - \"list all users\" \n"
+        "rooms           - \"list all rooms\" \n"
+        "connect <user>[,<user>...] - \"connect to users\" \n"
+        "disconnect <user> - \"disconnect from user\" \n"
+        "msg <user> <text> - \"send text to one user only\" \n"
+        "paste <bytes>   - \"send the next <bytes> bytes, newlines and all, as one message\" \n"
+        "batch <room> <ms> - \"merge room chat sent within ms, 0 = off (admin)\" \n"
+        "stats           - \"server metrics (admin)\" \n"
+        "trace on|off|dump [name] - \"span tracing (admin)\" \n"
+        "log [debug|info|warn|error] - \"show or set the log level (admin)\" \n"
+        "subscribe presence - \"push user/room changes instead of polling\" \n"
+        "unsubscribe presence - \"stop presence events\" \n"
+        "pong            - \"answer a keepalive @ping (any input will do)\" \n"
+        "exit/logout     - \"exit chat\" \n"
+        "help            - \"show this help\" \n"
+        "Any other text  - \"chat message\"\nchat>");
+    reply(c);
+    return 0;
+}
+
+static int cmd_subscribe(struct cmd_ctx *c) {
+    if (!c->argv[1] || strcmp(c->argv[1], "presence") != 0) {
+        sprintf(c->reply, "Usage: subscribe presence\nchat>");
+    } else if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+    } else {
+        presence_subscribe(c->me);
+        sprintf(c->reply, "Subscribed to presence\nchat>");
+    }
+    reply(c);
+    return 0;
+}
+
+static int cmd_unsubscribe(struct cmd_ctx *c) {
+    if (!c->argv[1] || strcmp(c->argv[1], "presence") != 0) {
+        sprintf(c->reply, "Usage: unsubscribe presence\nchat>");
+    } else {
+        if (c->me) presence_unsubscribe(c->me);
+        sprintf(c->reply, "Unsubscribed from presence\nchat>");
+    }
+    reply(c);
+    return 0;
+}
+
+/*
+ * Undo cmd_split from argv[i] to the end of the line, giving back the
+ * free text. Each separator comes back as a space, so runs of spaces
+ * survive; trailing whitespace is trimmed.
+ */
+static char *rest_of_line(struct cmd_ctx *c, int i) {
+    char *text = c->argv[i];
+    for (char *p = text; p < c->end; p++) {
+        if (*p == '\0') *p = ' ';
+    }
+    char *e = c->end;
+    while (e > text && isspace((unsigned char)e[-1])) e--;
+    *e = '\0';
+    return text;
+}
+
+static int cmd_msg(struct cmd_ctx *c) {
+    if (!c->argv[1] || !c->argv[2]) {
+        sprintf(c->reply, "Usage: msg <user> <text>\nchat>");
+    } else if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+    } else if (rate_limited(c->me, &c->me->chat_bucket, RL_CHAT)) {
+        return 0;   // dropped
+    } else if (deliver_direct(c->me, c->argv[1], rest_of_line(c, 2))) {
+        return 0;   // like chat, no reply on success
+    } else {
+        snprintf(c->reply, MAXBUFF, "User '%s' not found\nchat>", c->argv[1]);
+    }
+    reply(c);
+    return 0;
+}
+
+/*
+ * paste <bytes>: the next <bytes> bytes of input, newlines and all, are
+ * one message, relayed as they arrive (see stream.h) instead of through
+ * the MAXBUFF receive buffer. A refused paste is still read, and thrown
+ * away, so its payload is never taken for commands. No reply until the
+ * paste is complete.
+ */
+static int cmd_paste(struct cmd_ctx *c) {
+    char *end = NULL;
+    unsigned long len = c->argv[1] ? strtoul(c->argv[1], &end, 10) : 0;
+
+    if (!c->argv[1] || *end || len == 0 || len > STREAM_MAX) {
+        snprintf(c->reply, MAXBUFF, "Usage: paste <bytes> (at most %d), then the bytes\nchat>",
+                 STREAM_MAX);
+        reply(c);
+        return 0;
+    }
+    if (!c->me) {
+        sprintf(c->reply, "Error: user not initialized\nchat>");
+        reply(c);
+        return 0;
+    }
+
+    bool relay = true;
+    if (overload_shedding()) {
+        sprintf(c->reply, "Server busy, paste refused\nchat>");
+        reply(c);
+        relay = false;
+    } else if (rate_limited(c->me, &c->me->chat_bucket, RL_CHAT)) {
+        relay = false;  // dropped
+    }
+    if (!stream_begin(c->me, len, relay)) {
+        sprintf(c->reply, "Error: out of memory\nchat>");
+        reply(c);
+        return 0;
+    }
+
+    size_t used = stream_feed(c->me, c->rest, c->rest_len);
+    c->rest += used;
+    c->rest_len -= used;
+    return 0;
+}
+
+/* Answer to a keepalive ping; receiving it already counted as activity */
+static int cmd_pong(struct cmd_ctx *c) {
+    (void)c;
+    return 0;
+}
+
+static int cmd_exit(struct cmd_ctx *c) {
+    (void)c;
+    return -1;
+}
+
+/* Indexed by cmd_type_t; CMD_CHAT never gets here */
+static const cmd_handler_t handlers[CMD_NTYPES] = {
+    [CMD_CREATE]     = cmd_create,
+    [CMD_JOIN]       = cmd_join,
+    [CMD_LEAVE]      = cmd_leave,
+    [CMD_CONNECT]    = cmd_connect,
+    [CMD_DISCONNECT] = cmd_disconnect,
+    [CMD_BATCH]      = cmd_batch,
+    [CMD_ROOMS]      = cmd_rooms,
+    [CMD_USERS]      = cmd_users,
+    [CMD_LOGIN]      = cmd_login,
+    [CMD_HELP]       = cmd_help,
+    [CMD_EXIT]       = cmd_exit,
+    [CMD_STATS]      = cmd_stats,
+    [CMD_TRACE]      = cmd_trace,
+    [CMD_SUBSCRIBE]  = cmd_subscribe,
+    [CMD_UNSUBSCRIBE] = cmd_unsubscribe,
+    [CMD_PONG]       = cmd_pong,
+    [CMD_MSG]        = cmd_msg,
+    [CMD_LOG]        = cmd_log,
+    [CMD_PASTE]      = cmd_paste,
+};
+
+/*
+ * Parse and execute one chunk of input; *kind is set to the command
+ * type for the per-command timing histograms.
+ *
+ * Only the first word is looked at before dispatch, so a chat line is
+ * one hash lookup and goes out straight from the receive buffer.
+ * Commands are split in place.
+ */
+static int dispatch(user_t *me, int client, char *buffer, int received, cmd_type_t *kind) {
+   buffer[received] = '\0';
+
+   uint64_t parse_t0 = TRACE_START();
+   size_t wlen;
+   const char *word = cmd_first_word(buffer, &wlen);
+   *kind = cmd_lookup(word, wlen);
+   if (parse_t0) trace_span(TR_PARSE, parse_t0, now_ns(), *kind);
+
+   if (wlen == 0) {
+       send_ctrl(me, client, "\nchat>", strlen("\nchat>"));
+       return 0;
+   }
+
+   if (*kind == CMD_CHAT) {
+        /////////////////////////////////////////////////////////////
+        // Sending a chat message:
+        // Format:
+        // ::[userfrom]> <message>\nchat>
+
+        if (me && rate_limited(me, &me->chat_bucket, RL_CHAT)) {
+            return 0;
+        }
+
+        if (config.shards > 0) {
+            shard_broadcast(me, buffer);
+        } else {
+            broadcast_message(me, buffer);
+        }
+        if (me) {
+            fed_publish(FED_MSG, me->username, buffer);
+        }
+        return 0;
+   }
+
+   char *arguments[CMD_MAX_ARGS];
+   char replybuf[MAXBUFF];
+   struct cmd_ctx c = {
+       .me = me,
+       .client = client,
+       .argv = arguments,
+       .reply = replybuf,
+       .end = buffer + received,
+   };
+
+   // A paste's payload may come in the same read as its header line
+   if (*kind == CMD_PASTE) {
+       char *nl = memchr(buffer, '\n', received);
+       if (nl) {
+           *nl = '\0';
+           c.end = nl;
+           c.rest = nl + 1;
+           c.rest_len = buffer + received - c.rest;
+       }
+   }
+   c.argc = cmd_split(buffer, arguments, CMD_MAX_ARGS);
+
+   int rc = handlers[*kind](&c);
+
+   if (c.membership_changed && me) {
+       shard_sync_user(me);
+   }
+
+   // Whatever followed a short paste in that read is the next input
+   if (rc == 0 && c.rest_len > 0 && !(me && me->stream)) {
+       cmd_type_t next;
+       return dispatch(me, client, c.rest, c.rest_len, &next);
+   }
+   return rc;
+}
+
+/*
+ * Handle one chunk of input from a client. `buffer` holds `received`
+ * bytes and must be MAXBUFF long: it is NUL-terminated and split in
+ * place, and replies are built in a buffer of their own.
+ * Returns -1 when the client asked to leave, 0 otherwise.
+ */
+int client_handle(user_t *me, int client, char *buffer, int received) {
+   cmd_type_t kind = CMD_CHAT;
+   uint64_t t0 = now_ns();
+
+   atomic_fetch_add_explicit(&stats.bytes_in, received, memory_order_relaxed);
+   if (me) {
+       atomic_store_explicit(&me->last_active_ns, t0, memory_order_relaxed);
+   }
+   int rc = dispatch(me, client, buffer, received, &kind);
+
+   hist_record(&stats.cmd_ns[kind], now_ns() - t0);
+   TRACE_SPAN(TR_COMMAND, t0, kind);
+   return rc;
+}
+
+/*
+ * Main thread for each client. Receives all messages,
+ * and passes the data off to the correct function.
+ */
+void *client_receive(void *ptr) {
+   int client = (int)(intptr_t)ptr;  // socket
+   char buffer[MAXBUFF];
+
+   user_t *me = client_open(client);
+   if (!me) {
+      return NULL;
+   }
+
+   while (1) {
+      if (me->stream) {
+          if (stream_pump(me) < 0) {
+              break;   // client disconnected mid-paste
+          }
+          continue;
       }
-      else if (strcmp(arguments[0], "disconnect") == 0)
-      {             
-           if (!arguments[1]) {
-               sprintf(buffer, "Usage: disconnect <user>\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else if (!me) {
-               sprintf(buffer, "Error: user not initialized\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else {
-               user_t *other = find_user_by_name(arguments[1]);
-               if (other) {
-                   user_disconnect_dm(me, other);
-                   snprintf(buffer, MAXBUFF, "Disconnected DM from user '%s'\nchat>", arguments[1]);
-               } else {
-                   snprintf(buffer, MAXBUFF, "User '%s' not found\nchat>", arguments[1]);
-               }
-               send(client, buffer, strlen(buffer), 0);
-           }
-      }                  
-      else if (strcmp(arguments[0], "rooms") == 0)
-      {
-           printf("List all the rooms\n");
-
-           char listbuf[MAXBUFF];
-           list_all_rooms(listbuf);
-
-           snprintf(buffer, MAXBUFF, "Rooms:\n%s\nchat>", listbuf);
-           send(client , buffer , strlen(buffer) , 0 );                            
-      }   
-      else if (strcmp(arguments[0], "users") == 0)
-      {
-           printf("List all the users\n");
-
-           char listbuf[MAXBUFF];
-           list_all_users(listbuf);
-
-           snprintf(buffer, MAXBUFF, "Users:\n%s\nchat>", listbuf);
-           send(client , buffer , strlen(buffer) , 0 );
-      }                           
-      else if (strcmp(arguments[0], "login") == 0)
-      {
-           if (!arguments[1]) {
-               sprintf(buffer, "Usage: login <username>\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else if (!me) {
-               sprintf(buffer, "Error: user not initialized\nchat>");
-               send(client, buffer, strlen(buffer), 0);
-           } else {
-               user_rename(me, arguments[1]);
-               snprintf(buffer, MAXBUFF, "Logged in as '%s'\nchat>", arguments[1]);
-               send(client, buffer, strlen(buffer), 0);
-           }
-      } 
-      else if (strcmp(arguments[0], "help") == 0 )
-      {
-           sprintf(buffer,
-               "login <username> - \"login with username\" \n"
-               "create <room>   - \"create a room\" \n"
-               "join <room>     - \"join a room\" \n"
-               "leave <room>    - \"leave a room\" \n"
-               "users           - \"list all users\" \n"
-               "rooms           - \"list all rooms\" \n"
-               "connect <user>  - \"connect to user\" \n"
-               "disconnect <user> - \"disconnect from user\" \n"
-               "exit/logout     - \"exit chat\" \n"
-               "help            - \"show this help\" \n"
-               "Any other text  - \"chat message\"\nchat>");
-           send(client , buffer , strlen(buffer) , 0 ); 
+      int received = read(client, buffer, MAXBUFF - 1);
+      if (received <= 0) {
+          break;   // client disconnected
       }
-      else if (strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0)
-      {
-           if (me) {
-               remove_user(me);
-               me = NULL;
-           }
-           close(client);
-           break;    
-      }                         
-      else { 
-           /////////////////////////////////////////////////////////////
-           // Sending a chat message:
-           // Format:
-           // ::[userfrom]> <message>\nchat>
-
-           struct send_ctx ctx;
-           ctx.sender = me;
-           snprintf(ctx.message, MAXBUFF, "\n::%s> %s\nchat>",
-                    me ? me->username : "unknown", sbuffer);
-
-           for_each_user(send_message_cb, &ctx);
+      if (client_handle(me, client, buffer, received) < 0) {
+          break;   // exit/logout
       }
-
-      memset(buffer, 0, sizeof(buffer));
    }
 
+   client_close(me, client);
    return NULL;
 }
\ No newline at end of file
@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "server.h"
+#include "spsc.h"
+#include "shard.h"
+#include "stats.h"
+#include "clock.h"
+#include "trace.h"
+#include "log.h"
+#include "stream.h"
+
+#define MAX_EVENTS 64
+
+/* ========== Handle -> pointer hash map (shard-local, no locking) ========== */
+
+struct ptrmap {
+    void  **keys;
+    void  **vals;
+    size_t  cap;        // power of two
+    size_t  count;
+};
+
+/* Keys are user/room handles (never HANDLE_NONE) stored as pointers */
+static inline void *hkey(handle_t h) {
+    return (void *)(uintptr_t)h;
+}
+
+static size_t ptr_hash(const void *p, size_t mask) {
+    uint64_t x = (uintptr_t)p;
+    return (size_t)((x * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+static void ptrmap_init(struct ptrmap *m, size_t cap) {
+    m->cap = cap;
+    m->count = 0;
+    m->keys = calloc(cap, sizeof(void *));
+    m->vals = calloc(cap, sizeof(void *));
+}
+
+static void *ptrmap_get(const struct ptrmap *m, const void *key) {
+    size_t mask = m->cap - 1;
+    for (size_t i = ptr_hash(key, mask); m->keys[i]; i = (i + 1) & mask) {
+        if (m->keys[i] == key) return m->vals[i];
+    }
+    return NULL;
+}
+
+static void ptrmap_put(struct ptrmap *m, void *key, void *val);
+
+static void ptrmap_grow(struct ptrmap *m) {
+    struct ptrmap old = *m;
+    ptrmap_init(m, old.cap * 2);
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.keys[i]) ptrmap_put(m, old.keys[i], old.vals[i]);
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+static void ptrmap_put(struct ptrmap *m, void *key, void *val) {
+    if ((m->count + 1) * 10 > m->cap * 7) ptrmap_grow(m);
+
+    size_t mask = m->cap - 1;
+    size_t i = ptr_hash(key, mask);
+    while (m->keys[i] && m->keys[i] != key) i = (i + 1) & mask;
+    if (!m->keys[i]) m->count++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+/* Linear-probing delete with backward shift (no tombstones) */
+static void ptrmap_del(struct ptrmap *m, const void *key) {
+    size_t mask = m->cap - 1;
+    size_t i = ptr_hash(key, mask);
+    while (m->keys[i] && m->keys[i] != key) i = (i + 1) & mask;
+    if (!m->keys[i]) return;
+
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!m->keys[j]) break;
+        size_t home = ptr_hash(m->keys[j], mask);
+        /* move j back into the hole at i if its probe path passes i */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->keys[i] = m->keys[j];
+            m->vals[i] = m->vals[j];
+            i = j;
+        }
+    }
+    m->keys[i] = NULL;
+    m->vals[i] = NULL;
+    m->count--;
+}
+
+/* ========== Shard-local state ========== */
+
+/*
+ * A connection owned by a shard, with its routing snapshot. Rooms and
+ * DM targets are held as handles: they can be removed by other threads
+ * while the snapshot (or a message built from it) is still around.
+ */
+struct conn {
+    int       fd;
+    user_t   *user;
+    handle_t  handle;       // user's handle, key in shard->conns
+    handle_t *rooms;        // rooms the user is in
+    int       nrooms, rooms_cap;
+    handle_t *dms;          // one-way DM targets
+    int       ndms, dms_cap;
+    uint64_t stamp;     // last message delivered to this conn (dedup)
+};
+
+/* Local members of one room */
+struct member_vec {
+    struct conn **v;
+    int n, cap;
+};
+
+struct shard {
+    int           id;
+    pthread_t     tid;
+    int           epfd;
+    int           evfd;                 // wakes the loop when queues fill
+    spsc_queue_t  accept_q;             // main thread -> this shard
+    spsc_queue_t  in[MAX_SHARDS];       // shard i -> this shard
+    struct ptrmap conns;                // user handle -> struct conn*
+    struct ptrmap rooms;                // room handle -> struct member_vec*
+    uint64_t      epoch;                // per-message delivery stamp
+};
+
+/* A chat line in flight between shards; freed by the last shard done with it */
+struct shard_msg {
+    atomic_int refs;
+    atomic_int recipients;  // summed over shards for the fan-out histogram
+    uint64_t   created_ns;
+    handle_t   sender;
+    int        nrooms, ndms;
+    handle_t  *rooms;       // sorted by batching window, unbatched first
+    int       *windows;
+    handle_t  *dms;
+    size_t     len, line_len;
+    char      *payload;
+};
+
+static struct shard *shards = NULL;
+static int nshards = 0;
+static int next_shard = 0;              // round-robin cursor (main thread only)
+static __thread struct shard *self = NULL;
+
+static void shard_wake(struct shard *sh) {
+    uint64_t one = 1;
+    ssize_t n = write(sh->evfd, &one, sizeof(one));
+    (void)n;
+}
+
+/* ========== Routing table maintenance ========== */
+
+static void member_add(struct shard *sh, handle_t r, struct conn *c) {
+    struct member_vec *mv = ptrmap_get(&sh->rooms, hkey(r));
+    if (!mv) {
+        mv = calloc(1, sizeof(*mv));
+        if (!mv) return;
+        ptrmap_put(&sh->rooms, hkey(r), mv);
+    }
+    if (mv->n == mv->cap) {
+        int cap = mv->cap ? mv->cap * 2 : 8;
+        struct conn **v = realloc(mv->v, cap * sizeof(*v));
+        if (!v) return;
+        mv->v = v;
+        mv->cap = cap;
+    }
+    mv->v[mv->n++] = c;
+}
+
+static void member_remove(struct shard *sh, handle_t r, struct conn *c) {
+    struct member_vec *mv = ptrmap_get(&sh->rooms, hkey(r));
+    if (!mv) return;
+    for (int i = 0; i < mv->n; i++) {
+        if (mv->v[i] == c) {
+            mv->v[i] = mv->v[--mv->n];
+            return;
+        }
+    }
+}
+
+static void snap_room_cb(room_t *r, void *ctx) {
+    struct conn *c = ctx;
+    if (c->nrooms == c->rooms_cap) {
+        int cap = c->rooms_cap ? c->rooms_cap * 2 : 4;
+        handle_t *v = realloc(c->rooms, cap * sizeof(*v));
+        if (!v) return;
+        c->rooms = v;
+        c->rooms_cap = cap;
+    }
+    c->rooms[c->nrooms++] = room_handle(r);
+}
+
+static void snap_dm_cb(user_t *peer, void *ctx) {
+    struct conn *c = ctx;
+    if (c->ndms == c->dms_cap) {
+        int cap = c->dms_cap ? c->dms_cap * 2 : 4;
+        handle_t *v = realloc(c->dms, cap * sizeof(*v));
+        if (!v) return;
+        c->dms = v;
+        c->dms_cap = cap;
+    }
+    c->dms[c->ndms++] = user_handle(peer);
+}
+
+void shard_sync_user(user_t *u) {
+    if (!self || !u) return;
+
+    struct conn *c = ptrmap_get(&self->conns, hkey(user_handle(u)));
+    if (!c) return;
+
+    for (int i = 0; i < c->nrooms; i++) member_remove(self, c->rooms[i], c);
+    c->nrooms = 0;
+    c->ndms = 0;
+
+    user_memberships(u, snap_room_cb, snap_dm_cb, c);
+
+    for (int i = 0; i < c->nrooms; i++) member_add(self, c->rooms[i], c);
+}
+
+/* ========== Delivery ========== */
+
+static void shard_deliver(struct shard *sh, struct shard_msg *m) {
+    uint64_t stamp = ++sh->epoch;
+    int delivered = 0;
+    uint64_t t0 = TRACE_START();
+
+    struct conn *sc = ptrmap_get(&sh->conns, hkey(m->sender));
+    if (sc) sc->stamp = stamp;          // never echo to the sender
+
+    /* DMs and unbatched rooms go out immediately */
+    for (int i = 0; i < m->ndms; i++) {
+        struct conn *c = ptrmap_get(&sh->conns, hkey(m->dms[i]));
+        if (c && c->stamp != stamp) {
+            c->stamp = stamp;
+            outq_send(&c->user->out, OUT_CTRL, m->payload, m->len);
+            delivered++;
+        }
+    }
+
+    for (int i = 0; i < m->nrooms; i++) {
+        struct member_vec *mv = ptrmap_get(&sh->rooms, hkey(m->rooms[i]));
+        if (!mv) continue;
+        for (int k = 0; k < mv->n; k++) {
+            struct conn *c = mv->v[k];
+            if (c->stamp == stamp) continue;
+            c->stamp = stamp;
+            delivered++;
+            if (m->windows[i] == 0) {
+                outq_send(&c->user->out, OUT_CHAT, m->payload, m->len);
+            } else {
+                /* only reachable through batched rooms; shortest window first */
+                batch_enqueue(&c->user->batch, m->payload, m->line_len, m->windows[i]);
+            }
+        }
+    }
+
+    if (t0) trace_span(TR_FANOUT, t0, now_ns(), delivered);
+    atomic_fetch_add(&m->recipients, delivered);
+    if (atomic_fetch_sub(&m->refs, 1) == 1) {
+        /* last shard done: the message is fully fanned out */
+        hist_record(&stats.fanout_ns, now_ns() - m->created_ns);
+        hist_record(&stats.fanout_recipients, atomic_load(&m->recipients));
+        free(m);
+    }
+}
+
+static void drain_inbox(struct shard *sh) {
+    for (int i = 0; i < nshards; i++) {
+        struct shard_msg *m;
+        while ((m = spsc_pop(&sh->in[i])) != NULL) {
+            shard_deliver(sh, m);
+        }
+    }
+}
+
+void shard_broadcast(user_t *sender, const char *text) {
+    if (!self || !sender) return;
+
+    struct conn *c = ptrmap_get(&self->conns, hkey(user_handle(sender)));
+    if (!c) return;
+
+    char payload[MAXBUFF];
+    snprintf(payload, MAXBUFF, "\n::%s> %s\nchat>", sender->username, text);
+    size_t len = strlen(payload);
+
+    /* One allocation: header, room/DM arrays, windows, payload */
+    size_t sz = sizeof(struct shard_msg)
+              + (c->nrooms + c->ndms) * sizeof(handle_t)
+              + c->nrooms * sizeof(int)
+              + len + 1;
+    struct shard_msg *m = malloc(sz);
+    if (!m) return;
+
+    m->sender = c->handle;
+    m->nrooms = c->nrooms;
+    m->ndms = c->ndms;
+    m->rooms = (handle_t *)(m + 1);
+    m->dms = m->rooms + c->nrooms;
+    m->windows = (int *)(m->dms + c->ndms);
+    m->payload = (char *)(m->windows + c->nrooms);
+    m->len = len;
+    m->line_len = len - strlen("chat>");
+    memcpy(m->payload, payload, len + 1);
+    memcpy(m->dms, c->dms, c->ndms * sizeof(handle_t));
+
+    /* Insertion sort by window so unbatched rooms (0) come first */
+    for (int i = 0; i < c->nrooms; i++) {
+        handle_t r = c->rooms[i];
+        room_t *room = room_get(r);
+        int w = room ? room_batch_ms(room) : 0;
+        int j = i;
+        while (j > 0 && m->windows[j - 1] > w) {
+            m->rooms[j] = m->rooms[j - 1];
+            m->windows[j] = m->windows[j - 1];
+            j--;
+        }
+        m->rooms[j] = r;
+        m->windows[j] = w;
+    }
+
+    atomic_init(&m->refs, nshards);
+    atomic_init(&m->recipients, 0);
+    m->created_ns = now_ns();
+    atomic_fetch_add(&stats.messages, 1);
+
+    for (int i = 0; i < nshards; i++) {
+        if (i == self->id) continue;
+        struct shard *dst = &shards[i];
+        while (!spsc_push(&dst->in[self->id], m)) {
+            /* Peer is backed up: work off our own inbox so two full
+               shards can never wait on each other forever */
+            shard_wake(dst);
+            drain_inbox(self);
+            sched_yield();
+        }
+        shard_wake(dst);
+    }
+
+    shard_deliver(self, m);
+}
+
+/* ========== Connection lifecycle ========== */
+
+static void conn_open(struct shard *sh, int fd) {
+    /* One slow client must never block the loop (reads, paste splices) */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    user_t *me = client_open(fd);
+    if (!me) {
+        return;     // arena full; client_open closed the socket
+    }
+
+    struct conn *c = calloc(1, sizeof(*c));
+    if (!c) {
+        client_close(me, fd);
+        return;
+    }
+    c->fd = fd;
+    c->user = me;
+    c->handle = user_handle(me);
+
+    /* Register first: nothing needs undoing if this fails */
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("epoll_ctl: %s", strerror(errno));
+        client_close(me, fd);
+        free(c);
+        return;
+    }
+    ptrmap_put(&sh->conns, hkey(c->handle), c);
+    shard_sync_user(me);
+    outq_attach(&me->out, sh->epfd, c);     // this shard finishes its backed-up sends
+}
+
+static void conn_close(struct shard *sh, struct conn *c) {
+    outq_attach(&c->user->out, -1, NULL);
+    epoll_ctl(sh->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+
+    for (int i = 0; i < c->nrooms; i++) member_remove(sh, c->rooms[i], c);
+    ptrmap_del(&sh->conns, hkey(c->handle));
+
+    client_close(c->user, c->fd);
+    free(c->rooms);
+    free(c->dms);
+    free(c);
+}
+
+static void *shard_main(void *arg) {
+    struct shard *sh = arg;
+    struct epoll_event events[MAX_EVENTS];
+    char buffer[MAXBUFF];
+
+    self = sh;
+
+    while (1) {
+        int n = epoll_wait(sh->epfd, events, MAX_EVENTS, -1);
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (!c) {
+                uint64_t cnt;
+                ssize_t r = read(sh->evfd, &cnt, sizeof(cnt));
+                (void)r;
+                continue;
+            }
+
+            uint32_t evs = events[i].events;
+            if (evs & EPOLLOUT) outq_flush(&c->user->out);
+            if (!(evs & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+
+            if (c->user->stream) {
+                if (stream_pump(c->user) < 0) conn_close(sh, c);
+                continue;
+            }
+
+            int received = read(c->fd, buffer, MAXBUFF - 1);
+            if (received < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (received <= 0 || client_handle(c->user, c->fd, buffer, received) < 0) {
+                conn_close(sh, c);
+            }
+        }
+
+        void *item;
+        while ((item = spsc_pop(&sh->accept_q)) != NULL) {
+            conn_open(sh, (int)(intptr_t)item - 1);
+        }
+        drain_inbox(sh);
+    }
+
+    return NULL;
+}
+
+/* Any thread; the counts are racy snapshots, good enough for load signals */
+size_t shard_queue_depth(void) {
+    size_t n = 0;
+    for (int i = 0; i < nshards; i++) {
+        for (int j = 0; j < nshards; j++) {
+            if (j != i) n += spsc_size(&shards[i].in[j]);
+        }
+    }
+    return n;
+}
+
+/* ========== Startup and connection hand-off ========== */
+
+void shard_assign(int client) {
+    struct shard *sh = &shards[next_shard];
+    next_shard = (next_shard + 1) % nshards;
+
+    /* fd + 1 so that fd 0 is not mistaken for an empty queue */
+    while (!spsc_push(&sh->accept_q, (void *)(intptr_t)(client + 1))) {
+        shard_wake(sh);
+        sched_yield();
+    }
+    shard_wake(sh);
+}
+
+int shard_start(int n) {
+    if (n < 1 || n > MAX_SHARDS) return -1;
+
+    shards = calloc(n, sizeof(struct shard));
+    if (!shards) return -1;
+    nshards = n;
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+
+    for (int i = 0; i < n; i++) {
+        struct shard *sh = &shards[i];
+        sh->id = i;
+        sh->epfd = epoll_create1(0);
+        sh->evfd = eventfd(0, EFD_NONBLOCK);
+        if (sh->epfd < 0 || sh->evfd < 0) return -1;
+
+        if (spsc_init(&sh->accept_q, SHARD_QUEUE_SIZE) < 0) return -1;
+        for (int j = 0; j < n; j++) {
+            if (j != i && spsc_init(&sh->in[j], SHARD_QUEUE_SIZE) < 0) return -1;
+        }
+        ptrmap_init(&sh->conns, 256);
+        ptrmap_init(&sh->rooms, 64);
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->evfd, &ev);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&shards[i].tid, NULL, shard_main, &shards[i]) != 0) return -1;
+
+        /* One shard per core */
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(i % ncpu, &set);
+        pthread_setaffinity_np(shards[i].tid, sizeof(set), &set);
+        pthread_detach(shards[i].tid);
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "list.h"
+
+#define MAX_SHARDS        64
+#define SHARD_QUEUE_SIZE  4096    // slots per SPSC queue
+
+/*
+ * Sharded mode (-w N): N worker threads, each pinned to a core and
+ * running its own epoll loop over a partition of the connections.
+ *
+ * Each shard keeps a thread-local routing table: for every user it owns,
+ * a snapshot of that user's rooms and DM targets, plus a room -> local
+ * members index. A chat line is formatted once and handed to every other
+ * shard over a lock-free SPSC queue; each shard then delivers it to its
+ * own members. The list.c rw_lock is not taken on the chat hot path.
+ */
+
+int  shard_start(int nshards);
+void shard_assign(int client);                          // main thread only
+void shard_broadcast(user_t *sender, const char *text); // sender's shard only
+void shard_sync_user(user_t *u);                        // no-op outside a shard
+size_t shard_queue_depth(void);                         // chat lines waiting in inboxes
+
+#endif
@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include "spsc.h"
+
+int spsc_init(spsc_queue_t *q, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+
+    q->slots = calloc(cap, sizeof(void *));
+    if (!q->slots) return -1;
+    q->mask = cap - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+void spsc_destroy(spsc_queue_t *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+bool spsc_push(spsc_queue_t *q, void *item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head > q->mask) return false;     // full
+
+    q->slots[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+size_t spsc_size(spsc_queue_t *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+void *spsc_pop(spsc_queue_t *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) return NULL;               // empty
+
+    void *item = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return item;
+}
@@ -0,0 +1,29 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+/*
+ * Bounded lock-free single-producer / single-consumer queue of pointers.
+ * Exactly one thread may push and exactly one (other) thread may pop.
+ */
+typedef struct spsc_queue {
+    _Atomic size_t head;                    // next slot to pop (consumer)
+    char pad1[CACHE_LINE - sizeof(size_t)];
+    _Atomic size_t tail;                    // next slot to push (producer)
+    char pad2[CACHE_LINE - sizeof(size_t)];
+    size_t mask;                            // capacity - 1 (power of two)
+    void **slots;
+} spsc_queue_t;
+
+int   spsc_init(spsc_queue_t *q, size_t capacity);   // capacity rounded up to 2^n
+void  spsc_destroy(spsc_queue_t *q);
+bool  spsc_push(spsc_queue_t *q, void *item);        // false when full
+void *spsc_pop(spsc_queue_t *q);                     // NULL when empty
+size_t spsc_size(spsc_queue_t *q);                   // approximate from other threads
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "list.h"
+#include "ratelimit.h"
+#include "log.h"
+#include "overload.h"
+#include "stats.h"
+#include "trace.h"
+#include "outq.h"
+
+struct server_stats stats;
+
+ssize_t counted_send(int socket, const void *buf, size_t len) {
+    return counted_send_flags(socket, buf, len, 0);
+}
+
+ssize_t counted_send_flags(int socket, const void *buf, size_t len, int flags) {
+    uint64_t t0 = TRACE_START();
+    ssize_t n = send(socket, buf, len, flags);
+    if (t0) trace_span(TR_SEND, t0, now_ns(), (uint32_t)socket);
+    if (n > 0) {
+        atomic_fetch_add_explicit(&stats.bytes_out, n, memory_order_relaxed);
+    }
+    return n;
+}
+
+/* ========== Exposition ========== */
+
+struct out {
+    char  *buf;
+    size_t len, off;
+};
+
+static void emit(struct out *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void emit(struct out *o, const char *fmt, ...) {
+    if (o->off >= o->len) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->off, o->len - o->off, fmt, ap);
+    va_end(ap);
+    if (n > 0) o->off += n;
+    if (o->off > o->len) o->off = o->len;
+}
+
+static void emit_hist(struct out *o, const char *name, const char *labels, histogram_t *h) {
+    static const struct { const char *q; double p; } qs[] = {
+        { "0.5", 0.50 }, { "0.9", 0.90 }, { "0.99", 0.99 }, { "0.999", 0.999 }
+    };
+    const char *sep = labels[0] ? "," : "";
+
+    for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        emit(o, "%s{%s%squantile=\"%s\"} %lu\n", name, labels, sep, qs[i].q,
+             (unsigned long)hist_percentile(h, qs[i].p));
+    }
+    emit(o, "%s_max{%s} %lu\n", name, labels, atomic_load(&h->max));
+    emit(o, "%s_sum{%s} %lu\n", name, labels, atomic_load(&h->sum));
+    emit(o, "%s_count{%s} %lu\n", name, labels, atomic_load(&h->count));
+}
+
+size_t stats_format(char *buffer, size_t len) {
+    struct out o = { buffer, len, 0 };
+    if (!buffer || len == 0) return 0;
+    buffer[0] = '\0';
+
+    emit(&o, "chat_bytes_in_total %lu\n", atomic_load(&stats.bytes_in));
+    emit(&o, "chat_bytes_out_total %lu\n", atomic_load(&stats.bytes_out));
+    emit(&o, "chat_connections_active %lu\n", atomic_load(&stats.conns_active));
+    emit(&o, "chat_connections_total %lu\n", atomic_load(&stats.conns_total));
+    emit(&o, "chat_connections_reaped_total %lu\n", atomic_load(&stats.conns_reaped));
+    emit(&o, "chat_pings_total %lu\n", atomic_load(&stats.pings));
+    emit(&o, "chat_users %lu\n", list_user_count());
+    emit(&o, "chat_rooms %lu\n", list_room_count());
+    emit(&o, "chat_messages_total %lu\n", atomic_load(&stats.messages));
+    emit(&o, "chat_direct_messages_total %lu\n", atomic_load(&stats.direct_messages));
+    emit(&o, "chat_pastes_total %lu\n", atomic_load(&stats.pastes));
+    emit(&o, "chat_paste_bytes_total %lu\n", atomic_load(&stats.paste_bytes));
+    emit(&o, "chat_paste_spliced_bytes_total %lu\n", atomic_load(&stats.paste_spliced_bytes));
+    emit(&o, "chat_log_dropped_total %lu\n", log_dropped());
+
+    for (int c = 0; c < RL_NCLASSES; c++) {
+        const char *cls = (c == RL_CHAT) ? "chat" : "cmd";
+        emit(&o, "chat_ratelimit_delayed_total{class=\"%s\"} %lu\n", cls, ratelimit_delayed(c));
+        emit(&o, "chat_ratelimit_dropped_total{class=\"%s\"} %lu\n", cls, ratelimit_dropped(c));
+    }
+
+    emit(&o, "chat_outq_backlogged %lu\n", outq_backlogged_count());
+    for (int c = 0; c < OUT_NCLASSES; c++) {
+        const char *cls = (c == OUT_CTRL) ? "ctrl" : "chat";
+        emit(&o, "chat_outq_dropped_bytes_total{class=\"%s\"} %lu\n", cls, outq_dropped(c));
+    }
+    emit(&o, "chat_outq_backlog_bytes %zu\n", outq_backlog_bytes());
+    emit(&o, "chat_outq_shed_bytes_total %lu\n", outq_shed());
+
+    emit(&o, "chat_overloaded %d\n", overload_on() ? 1 : 0);
+    emit(&o, "chat_overload_episodes_total %lu\n", overload_episodes());
+    emit(&o, "chat_connections_refused_total %lu\n", overload_refused());
+    for (int s = 0; s < OVL_NSIGNALS; s++) {
+        emit(&o, "chat_overload_signal{signal=\"%s\"} %lu\n",
+             overload_signal_name(s), overload_signal(s));
+        emit(&o, "chat_overload_limit{signal=\"%s\"} %lu\n",
+             overload_signal_name(s), overload_limit(s));
+    }
+
+    for (int t = 0; t < CMD_NTYPES; t++) {
+        if (atomic_load(&stats.cmd_ns[t].count) == 0) continue;
+        char labels[32];
+        snprintf(labels, sizeof(labels), "cmd=\"%s\"", cmd_name(t));
+        emit_hist(&o, "chat_command_ns", labels, &stats.cmd_ns[t]);
+    }
+
+    emit_hist(&o, "chat_fanout_ns", "", &stats.fanout_ns);
+    emit_hist(&o, "chat_fanout_recipients", "", &stats.fanout_recipients);
+    emit_hist(&o, "chat_lock_wait_ns", "mode=\"read\"", &stats.lock_read_wait_ns);
+    emit_hist(&o, "chat_lock_wait_ns", "mode=\"write\"", &stats.lock_write_wait_ns);
+
+    return o.off;
+}
+
+/* ========== Unix socket endpoint ========== */
+
+static void *endpoint_main(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    char *buf = malloc(STATS_TEXT_MAX);
+    if (!buf) return NULL;
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) continue;
+
+        size_t n = stats_format(buf, STATS_TEXT_MAX);
+        size_t off = 0;
+        while (off < n) {
+            ssize_t w = write(fd, buf + off, n - off);
+            if (w <= 0) break;
+            off += w;
+        }
+        close(fd);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int stats_start_endpoint(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, endpoint_main, (void *)(intptr_t)fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "hist.h"
+#include "command.h"
+
+struct server_stats {
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+    atomic_ulong conns_active;
+    atomic_ulong conns_total;
+    atomic_ulong conns_reaped;          // dropped by the keepalive
+    atomic_ulong pings;                 // keepalive pings sent
+    atomic_ulong messages;              // chat lines fanned out
+    atomic_ulong direct_messages;       // msg lines delivered to one user
+    atomic_ulong pastes;                // streamed pastes relayed
+    atomic_ulong paste_bytes;           // paste payload read from senders
+    atomic_ulong paste_spliced_bytes;   // paste bytes sent without a user-space copy
+
+    histogram_t  cmd_ns[CMD_NTYPES];    // command handling time
+    histogram_t  fanout_ns;             // time to deliver one chat line
+    histogram_t  fanout_recipients;     // recipients of one chat line
+    histogram_t  lock_read_wait_ns;     // begin_read() wait
+    histogram_t  lock_write_wait_ns;    // begin_write() wait
+};
+
+extern struct server_stats stats;
+
+/* send() that counts outgoing bytes */
+ssize_t    counted_send(int socket, const void *buf, size_t len);
+ssize_t    counted_send_flags(int socket, const void *buf, size_t len, int flags);
+
+/* Render everything as scrapeable "name{labels} value" lines */
+size_t     stats_format(char *buffer, size_t len);
+
+/* Serve stats_format() to anyone connecting to the Unix socket at path */
+int        stats_start_endpoint(const char *path);
+
+#endif
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "server.h"
+#include "stream.h"
+#include "stats.h"
+#include "clock.h"
+#include "log.h"
+
+struct stream {
+    pthread_mutex_t lock;           // reader vs the deadline timer
+    user_t       *sender;
+    int           socket;
+    size_t        total, left;
+    bool          relay;            // false: swallow the bytes
+    atomic_bool   cut;              // overdue: lanes closed, swallow the rest
+    int           n, cap;           // recipients
+    handle_t     *users;
+    struct rcpt {
+        out_lane_t *lane;           // NULL once closed
+        bool        behind;         // lane overflowed; the paste was cut short
+    }            *rcpt;
+    int           pipe[2];          // chunk spliced from the socket (-1: plain reads)
+    int           scratch[2];       // tee target for one recipient
+    wheel_timer_t deadline;
+};
+
+static int devnull = -1;
+static pthread_once_t devnull_once = PTHREAD_ONCE_INIT;
+
+static void open_devnull(void) {
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+}
+
+static void close_pipes(struct stream *s) {
+    for (int i = 0; i < 2; i++) {
+        if (s->pipe[i] >= 0) close(s->pipe[i]);
+        if (s->scratch[i] >= 0) close(s->scratch[i]);
+        s->pipe[i] = s->scratch[i] = -1;
+    }
+}
+
+/* Throw away n bytes sitting in a pipe */
+static void pipe_skip(int fd, size_t n) {
+    char trash[4096];
+    while (n > 0) {
+        ssize_t k = -1;
+        if (devnull >= 0) k = splice(fd, NULL, devnull, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (k <= 0) k = read(fd, trash, n < sizeof(trash) ? n : sizeof(trash));
+        if (k <= 0) return;
+        n -= k;
+    }
+}
+
+/* ========== Recipients ========== */
+
+struct begin_ctx {
+    struct stream *s;
+    char   head[MAX_NAME + 64];
+    size_t head_len;
+};
+
+/* Open a lane on u for the paste; caller holds the read lock */
+static void add_rcpt(struct begin_ctx *b, user_t *u) {
+    struct stream *s = b->s;
+    if (u == s->sender || u->node != 0) return;     // remote users are not streamed to
+
+    if (s->n == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 16;
+        handle_t *users = realloc(s->users, cap * sizeof(*users));
+        if (users) s->users = users;
+        struct rcpt *rcpt = realloc(s->rcpt, cap * sizeof(*rcpt));
+        if (rcpt) s->rcpt = rcpt;
+        if (!users || !rcpt) return;
+        s->cap = cap;
+    }
+
+    out_lane_t *l = outq_lane_open(&u->out, b->head, b->head_len);
+    if (!l) return;
+    s->users[s->n] = user_handle(u);
+    s->rcpt[s->n].lane = l;
+    s->rcpt[s->n].behind = false;
+    s->n++;
+}
+
+/* Batched rooms are not waited on: a paste goes out as it arrives */
+static void audience_cb(user_t *u, void *arg) {
+    struct begin_ctx *b = arg;
+    int batch_ms = 0;
+    if (audience_class(b->s->sender, u, &batch_ms) >= 0 || batch_ms > 0) add_rcpt(b, u);
+}
+
+static void audience_single_cb(user_t *u, bool dm, void *arg) {
+    (void)dm;
+    add_rcpt(arg, u);
+}
+
+static void close_cb(user_t *u, int i, void *arg) {
+    struct stream *s = arg;
+    struct rcpt *r = &s->rcpt[i];
+    if (!r->lane) return;
+
+    const char *tail = (atomic_load(&s->cut) || s->left > 0 || r->behind)
+        ? "\n[paste cut off]\nchat>" : "\nchat>";
+    outq_lane_close(&u->out, r->lane, tail, strlen(tail));
+    r->lane = NULL;
+}
+
+/* Let every recipient move on; caller holds s->lock */
+static void close_lanes(struct stream *s) {
+    with_users(s->users, s->n, close_cb, s);
+}
+
+/* ========== Relaying one chunk ========== */
+
+struct chunk_ctx {
+    struct stream *s;
+    size_t         len;
+    bool           piped;           // the chunk is (still) in s->pipe
+    out_buf_t     *buf;             // the chunk in memory, once anyone needs it
+};
+
+/*
+ * outq_lane_direct callback: tee the chunk into the scratch pipe and
+ * splice it to the recipient. Its socket is blocking, so it is never
+ * offered more than half the room left in its send buffer; whatever is
+ * not taken goes through the queue instead.
+ */
+static ssize_t splice_to(int socket, void *arg) {
+    struct chunk_ctx *c = arg;
+    struct stream *s = c->s;
+
+    int sndbuf = 0, unsent = 0;
+    socklen_t sl = sizeof(sndbuf);
+    if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sl) < 0 ||
+        ioctl(socket, SIOCOUTQ, &unsent) < 0) {
+        return -1;
+    }
+    size_t room = sndbuf > unsent ? (size_t)(sndbuf - unsent) / 2 : 0;
+    size_t want = c->len < room ? c->len : room;
+    if (want == 0) return 0;
+
+    ssize_t t = tee(s->pipe[0], s->scratch[1], want, SPLICE_F_NONBLOCK);
+    if (t <= 0) return -1;
+    ssize_t n = splice(s->scratch[0], NULL, socket, NULL, t, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) n = 0;
+    if (n < t) pipe_skip(s->scratch[0], t - n);    // leave the scratch pipe empty
+
+    if (n > 0) {
+        atomic_fetch_add_explicit(&stats.bytes_out, n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats.paste_spliced_bytes, n, memory_order_relaxed);
+    }
+    return n;
+}
+
+/* Pull the chunk out of the pipe for recipients that have to queue it */
+static bool materialize(struct chunk_ctx *c) {
+    if (c->buf) return true;
+    if (!(c->buf = outbuf_new(c->len))) return false;
+
+    size_t got = 0;
+    while (got < c->len) {
+        ssize_t k = read(c->s->pipe[0], c->buf->data + got, c->len - got);
+        if (k <= 0) break;
+        got += k;
+    }
+    c->piped = false;
+    if (got < c->len) {
+        outbuf_put(c->buf);
+        c->buf = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void relay_cb(user_t *u, int i, void *arg) {
+    struct chunk_ctx *c = arg;
+    struct rcpt *r = &c->s->rcpt[i];
+    if (!r->lane || r->behind) return;
+
+    size_t done = 0;
+    if (c->piped) {
+        ssize_t n = outq_lane_direct(&u->out, r->lane, splice_to, c);
+        if (n > 0) done = n;
+        if (done == c->len) return;
+    }
+    if (!materialize(c) || !outq_lane_send(&u->out, r->lane, c->buf, done, c->len - done)) {
+        r->behind = true;
+    }
+}
+
+/* Hand one chunk (in buf, or else in s->pipe) to every recipient; caller holds s->lock */
+static void relay_chunk(struct stream *s, out_buf_t *buf, size_t len) {
+    struct chunk_ctx c = { .s = s, .len = len, .piped = (buf == NULL), .buf = buf };
+    if (buf) atomic_fetch_add(&buf->refs, 1);
+
+    with_users(s->users, s->n, relay_cb, &c);
+
+    if (c.piped) pipe_skip(s->pipe[0], len);       // every recipient took it by splice
+    outbuf_put(c.buf);
+    atomic_fetch_add_explicit(&stats.paste_bytes, len, memory_order_relaxed);
+}
+
+/* ========== Lifecycle ========== */
+
+/* Wheel callback: the paste is overdue (sender too slow, or gone quiet) */
+static void deadline_due(wheel_timer_t *t, void *arg) {
+    (void)t;
+    struct stream *s = arg;
+    pthread_mutex_lock(&s->lock);
+    if (s->relay && !atomic_exchange(&s->cut, true)) {
+        close_lanes(s);
+        const char *msg = "Paste cut off: sent too slowly, the rest is discarded\nchat>";
+        outq_send(&s->sender->out, OUT_CTRL, msg, strlen(msg));
+        log_info("%s: paste cut off after %zu of %zu bytes", s->sender->username,
+                 s->total - s->left, s->total);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+bool stream_begin(user_t *u, size_t len, bool relay) {
+    struct stream *s = calloc(1, sizeof(*s));
+    if (!s) return false;
+
+    pthread_mutex_init(&s->lock, NULL);
+    s->sender = u;
+    s->socket = u->socket;
+    s->total = s->left = len;
+    s->relay = relay;
+    atomic_init(&s->cut, false);
+    s->pipe[0] = s->pipe[1] = s->scratch[0] = s->scratch[1] = -1;
+    wheel_timer_init(&s->deadline, deadline_due, s);
+
+    if (relay) {
+        /* No pipes (fd limit): the chunks go through memory instead */
+        pthread_once(&devnull_once, open_devnull);
+        if (pipe2(s->pipe, O_NONBLOCK | O_CLOEXEC) < 0 ||
+            pipe2(s->scratch, O_NONBLOCK | O_CLOEXEC) < 0) {
+            close_pipes(s);
+        }
+
+        struct begin_ctx b = { .s = s };
+        b.head_len = snprintf(b.head, sizeof(b.head), "\n::%s> [paste, %zu bytes]\n",
+                              u->username, len);
+        if (single_membership) {
+            for_each_audience(u, audience_single_cb, &b);
+        } else {
+            for_each_user(audience_cb, &b);
+        }
+        atomic_fetch_add(&stats.pastes, 1);
+    }
+
+    u->stream = s;
+    wheel_arm(&s->deadline, STREAM_GRACE_MS + (uint64_t)len * 1000 / STREAM_MIN_RATE);
+    return true;
+}
+
+/* Close the lanes and free the stream; the reader is done with it */
+static void stream_end(user_t *u) {
+    struct stream *s = u->stream;
+    wheel_cancel(&s->deadline);
+
+    pthread_mutex_lock(&s->lock);
+    bool cut = atomic_load(&s->cut);
+    if (s->relay && !cut) close_lanes(s);
+    pthread_mutex_unlock(&s->lock);
+
+    if (s->relay && !cut && s->left == 0) {
+        char msg[96];
+        int n = snprintf(msg, sizeof(msg), "Pasted %zu bytes to %d users\nchat>", s->total, s->n);
+        outq_send(&u->out, OUT_CTRL, msg, n);
+        log_debug("%s pasted %zu bytes to %d users", u->username, s->total, s->n);
+    }
+
+    close_pipes(s);
+    pthread_mutex_destroy(&s->lock);
+    free(s->users);
+    free(s->rcpt);
+    free(s);
+    u->stream = NULL;
+}
+
+size_t stream_feed(user_t *u, const char *buf, size_t len) {
+    struct stream *s = u->stream;
+    if (!s) return 0;
+    size_t n = len < s->left ? len : s->left;
+    if (n == 0) return 0;
+
+    s->left -= n;
+    out_buf_t *b = s->relay ? outbuf_new(n) : NULL;
+    if (b) {
+        memcpy(b->data, buf, n);
+        pthread_mutex_lock(&s->lock);
+        if (!atomic_load(&s->cut)) relay_chunk(s, b, n);
+        pthread_mutex_unlock(&s->lock);
+        outbuf_put(b);
+    }
+
+    if (s->left == 0) stream_end(u);
+    return n;
+}
+
+int stream_pump(user_t *u) {
+    struct stream *s = u->stream;
+    size_t want = s->left < STREAM_CHUNK ? s->left : STREAM_CHUNK;
+    out_buf_t *buf = NULL;
+    bool piped = false;
+    ssize_t n;
+
+    if (!s->relay || atomic_load(&s->cut)) {
+        char trash[4096];
+        n = read(s->socket, trash, want < sizeof(trash) ? want : sizeof(trash));
+    } else if (s->pipe[0] >= 0) {
+        n = splice(s->socket, NULL, s->pipe[1], NULL, want, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINVAL) {
+            close_pipes(s);     // this socket does not splice; read instead
+            return 0;
+        }
+        piped = true;
+    } else {
+        if (!(buf = outbuf_new(want))) return -1;
+        n = read(s->socket, buf->data, want);
+    }
+
+    if (n <= 0) {
+        outbuf_put(buf);
+        return (n < 0 && (errno == EINTR || errno == EAGAIN)) ? 0 : -1;
+    }
+    atomic_fetch_add_explicit(&stats.bytes_in, n, memory_order_relaxed);
+    atomic_store_explicit(&u->last_active_ns, now_ns(), memory_order_relaxed);
+    s->left -= n;
+
+    if (piped || buf) {
+        pthread_mutex_lock(&s->lock);
+        if (!atomic_load(&s->cut)) relay_chunk(s, buf, n);
+        else if (piped) pipe_skip(s->pipe[0], n);      // cut off while we were reading
+        pthread_mutex_unlock(&s->lock);
+        outbuf_put(buf);
+    }
+
+    if (s->left == 0) stream_end(u);
+    return 0;
+}
+
+void stream_abort(user_t *u) {
+    if (u->stream) stream_end(u);
+}
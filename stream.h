@@ -0,0 +1,49 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "list.h"
+
+#define STREAM_CHUNK     16384              // bytes relayed per read; fits an empty pipe
+#define STREAM_MAX       (4 * 1024 * 1024)  // largest paste
+#define STREAM_GRACE_MS  10000              // a paste must be complete within this
+#define STREAM_MIN_RATE  65536              // plus its length at this many bytes/s
+
+/*
+ * Streamed pastes: "paste <bytes>" followed by exactly that many bytes
+ * of anything, newlines included, delivered as one message to everyone
+ * who would get the sender's chat at the time the paste starts.
+ *
+ * Nothing is buffered whole. Each chunk is relayed as it comes in: it
+ * is spliced from the sender's socket into a pipe and tee'd from there
+ * to every recipient whose queue is idle, so the bytes never enter user
+ * space. Recipients that are behind get a reference to one shared copy
+ * of the chunk instead. Each recipient has an outq lane for the paste,
+ * which keeps everything else, replies and DMs included, off the wire
+ * until the paste is complete, so the paste arrives in one piece.
+ * The lifetime of a paste is bounded (STREAM_GRACE_MS plus its length at
+ * STREAM_MIN_RATE), so a sender trickling bytes cannot hold up the
+ * recipients' other traffic for long; an overdue paste is cut off for
+ * everyone.
+ *
+ * The owning reader (the client's thread, or its shard) drives a paste;
+ * while u->stream is set it calls stream_pump instead of reading input.
+ */
+
+/*
+ * Start a paste of len bytes from u. With relay false the bytes are read
+ * and thrown away (a refused paste). False if out of memory.
+ */
+bool   stream_begin(user_t *u, size_t len, bool relay);
+
+/* Relay payload that was read along with the header; returns bytes used */
+size_t stream_feed(user_t *u, const char *buf, size_t len);
+
+/* Read and relay the next chunk from u's socket; -1 on EOF or error */
+int    stream_pump(user_t *u);
+
+/* u is going away mid-paste: recipients see it cut off */
+void   stream_abort(user_t *u);
+
+#endif
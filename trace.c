@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+struct trace_event {
+    uint64_t start_ns;
+    uint32_t dur_ns;
+    uint16_t kind;
+    uint16_t pad;
+    uint32_t arg;
+    uint32_t pad2;
+};
+
+/*
+ * One ring per thread: single writer (the owner), read only by the
+ * dumper. When the owner exits the ring is released and the next new
+ * thread takes it over, so thread-per-client mode does not leak a ring
+ * per connection; the dead thread's events go with it.
+ */
+struct trace_ring {
+    atomic_ulong        head;       // total events ever written
+    int                 tid;
+    atomic_bool         owned;
+    struct trace_ring  *next;       // registry of all rings
+    struct trace_event  events[TRACE_RING_SIZE];
+};
+
+atomic_bool trace_enabled = false;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings = NULL;
+static int nrings = 0;
+static __thread struct trace_ring *my_ring = NULL;
+static __thread bool ring_denied = false;     // every ring was taken
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static const char *kind_names[TR_NKINDS] = {
+    "lock_read_wait", "lock_write_wait", "send", "parse",
+    "command", "fanout", "batch_flush"
+};
+
+static const char *kind_cats[TR_NKINDS] = {
+    "lock", "lock", "io", "cpu", "cpu", "io", "io"
+};
+
+void trace_set(bool on) {
+    atomic_store(&trace_enabled, on);
+}
+
+static void ring_release(void *p) {
+    struct trace_ring *r = p;
+    atomic_store_explicit(&r->owned, false, memory_order_release);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+/* First span on a thread takes a released ring or registers a new one */
+static struct trace_ring *ring_get(void) {
+    if (my_ring) return my_ring;
+    if (ring_denied) return NULL;
+    pthread_once(&key_once, make_key);
+    int tid = (int)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&registry_lock);
+    struct trace_ring *r;
+    for (r = rings; r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->owned, &expected, true)) {
+            atomic_store(&r->head, 0);
+            break;
+        }
+    }
+    if (!r && nrings < TRACE_MAX_RINGS) {
+        r = calloc(1, sizeof(*r));
+        if (r) {
+            atomic_init(&r->owned, true);
+            r->next = rings;
+            rings = r;
+            nrings++;
+        }
+    }
+    if (r) r->tid = tid;
+    pthread_mutex_unlock(&registry_lock);
+    if (!r) {
+        ring_denied = true;
+        return NULL;
+    }
+
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+void trace_span(trace_kind_t kind, uint64_t start_ns, uint64_t end_ns, uint32_t arg) {
+    if (!trace_on()) return;
+
+    struct trace_ring *r = ring_get();
+    if (!r) return;
+
+    unsigned long h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    struct trace_event *e = &r->events[h & (TRACE_RING_SIZE - 1)];
+    e->start_ns = start_ns;
+    e->dur_ns = (uint32_t)(end_ns - start_ns);
+    e->kind = kind;
+    e->arg = arg;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+long trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    /* Pause recording so rings are not overwritten while we read them */
+    bool was_on = trace_on();
+    trace_set(false);
+
+    long n = 0;
+    int pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&registry_lock);
+    for (struct trace_ring *r = rings; r; r = r->next) {
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                   "\"args\":{\"name\":\"thread %d\"}}",
+                n ? ",\n" : "", pid, r->tid, r->tid);
+        n++;
+
+        for (unsigned long i = first; i < head; i++) {
+            struct trace_event *e = &r->events[i & (TRACE_RING_SIZE - 1)];
+            if (e->kind >= TR_NKINDS) continue;
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                       "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%u}}",
+                    kind_names[e->kind], kind_cats[e->kind],
+                    e->start_ns / 1000.0, e->dur_ns / 1000.0, pid, r->tid, e->arg);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    trace_set(was_on);
+    return n;
+}
@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "clock.h"
+
+/*
+ * Low-overhead span tracing. Each thread records timestamped spans into
+ * its own fixed-size ring (no locks, oldest entries are overwritten).
+ * At most TRACE_MAX_RINGS threads are traced at once; threads that find
+ * every ring taken are not traced.
+ * When tracing is off the only cost is one relaxed load and a branch.
+ * trace_dump() writes the rings as Chrome trace JSON (chrome://tracing,
+ * Perfetto).
+ */
+
+#define TRACE_RING_SIZE 8192        // events per thread (power of two); 192 KiB
+#define TRACE_MAX_RINGS 256         // memory is bounded at 48 MiB
+
+typedef enum {
+    TR_LOCK_READ = 0,   // waiting in begin_read()
+    TR_LOCK_WRITE,      // waiting in begin_write()
+    TR_SEND,            // one send() to a client
+    TR_PARSE,           // tokenizing a client line
+    TR_COMMAND,         // handling one client input end to end
+    TR_FANOUT,          // delivering one chat line
+    TR_BATCH_FLUSH,     // flushing due batch buffers
+    TR_NKINDS
+} trace_kind_t;
+
+extern atomic_bool trace_enabled;
+
+static inline bool trace_on(void) {
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+/* Record a span ending now; arguments are not evaluated when tracing is off */
+#define TRACE_SPAN(kind, start_ns, arg) \
+    do { if (trace_on()) trace_span((kind), (start_ns), now_ns(), (arg)); } while (0)
+
+/* Start time for a span, or 0 when tracing is off */
+#define TRACE_START() (trace_on() ? now_ns() : 0)
+
+void trace_set(bool on);
+void trace_span(trace_kind_t kind, uint64_t start_ns, uint64_t end_ns, uint32_t arg);
+
+/* Write every thread's ring to path; returns events written or -1 */
+long trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include "clock.h"
+#include "wheel.h"
+
+#define TICK_NS ((uint64_t)WHEEL_TICK_MS * 1000000ull)
+
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wheel_cond;              // armed timers appeared (CLOCK_MONOTONIC)
+static pthread_cond_t  done_cond = PTHREAD_COND_INITIALIZER;   // a callback returned
+
+/* Circular lists with sentinel heads, so unlinking never needs the head */
+static wheel_timer_t slots[WHEEL_SLOTS];
+static wheel_timer_t expired;                   // due, waiting for their callback
+static wheel_timer_t *running;                  // callback in progress
+static uint64_t current;                        // last tick processed
+static uint64_t wake_tick;                      // tick the thread sleeps until (0 = not sleeping)
+static unsigned long armed;
+
+static void list_reset(wheel_timer_t *head) {
+    head->next = head->prev = head;
+}
+
+static void link_tail(wheel_timer_t *head, wheel_timer_t *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* Caller holds wheel_lock; lets timers be armed before wheel_start() */
+static void lists_init(void) {
+    if (expired.next) return;
+    for (int i = 0; i < WHEEL_SLOTS; i++) list_reset(&slots[i]);
+    list_reset(&expired);
+}
+
+static void unlink_timer(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void wheel_timer_init(wheel_timer_t *t, wheel_fn fn, void *arg) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void wheel_arm(wheel_timer_t *t, uint64_t delay_ms) {
+    uint64_t ticks = (delay_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (ticks == 0) ticks = 1;
+
+    pthread_mutex_lock(&wheel_lock);
+    lists_init();
+    if (t->next) {
+        unlink_timer(t);
+    } else {
+        armed++;
+    }
+    /* Ticks are clock based, so this is right even while the wheel sleeps */
+    t->expires = now_ns() / TICK_NS + ticks;
+    link_tail(&slots[t->expires % WHEEL_SLOTS], t);
+    if (armed == 1 || t->expires < wake_tick) pthread_cond_signal(&wheel_cond);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+void wheel_cancel(wheel_timer_t *t) {
+    pthread_mutex_lock(&wheel_lock);
+    /*
+     * Wait out a running callback first: it may re-arm its own timer.
+     * Once t is unlinked under the lock it cannot start running again.
+     */
+    while (running == t) {
+        pthread_cond_wait(&done_cond, &wheel_lock);
+    }
+    if (t->next) {
+        unlink_timer(t);
+        armed--;
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/* Move everything due by tick `now` to the expired list; caller holds wheel_lock */
+static void advance(uint64_t now) {
+    if (now - current > WHEEL_SLOTS) current = now - WHEEL_SLOTS;
+
+    while (current < now) {
+        current++;
+        wheel_timer_t *head = &slots[current % WHEEL_SLOTS];
+        wheel_timer_t *t = head->next;
+        while (t != head) {
+            wheel_timer_t *next = t->next;
+            if (t->expires <= current) {
+                unlink_timer(t);
+                link_tail(&expired, t);
+            }
+            t = next;
+        }
+    }
+}
+
+static void *wheel_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&wheel_lock);
+    lists_init();
+    current = now_ns() / TICK_NS;
+    while (1) {
+        while (armed == 0) {
+            pthread_cond_wait(&wheel_cond, &wheel_lock);
+        }
+        if (current + WHEEL_SLOTS < now_ns() / TICK_NS) {
+            current = now_ns() / TICK_NS - WHEEL_SLOTS;  // idle stretch: one turn covers all
+        }
+
+        /* Sleep through empty slots; wheel_arm wakes us for anything sooner */
+        uint64_t target = current + 1;
+        while (target < current + WHEEL_SLOTS &&
+               slots[target % WHEEL_SLOTS].next == &slots[target % WHEEL_SLOTS]) {
+            target++;
+        }
+        uint64_t now = now_ns() / TICK_NS;
+        if (now < target) {
+            uint64_t at = target * TICK_NS;
+            struct timespec ts;
+            ts.tv_sec = at / 1000000000ull;
+            ts.tv_nsec = at % 1000000000ull;
+            wake_tick = target;
+            pthread_cond_timedwait(&wheel_cond, &wheel_lock, &ts);
+            wake_tick = 0;
+            continue;
+        }
+
+        advance(now);
+
+        while (expired.next != &expired) {
+            wheel_timer_t *t = expired.next;
+            unlink_timer(t);
+            armed--;
+            running = t;
+            pthread_mutex_unlock(&wheel_lock);
+
+            t->fn(t, t->arg);
+
+            pthread_mutex_lock(&wheel_lock);
+            running = NULL;
+            pthread_cond_broadcast(&done_cond);
+        }
+    }
+    return NULL;
+}
+
+int wheel_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);   // ticks are now_ns() based
+    pthread_cond_init(&wheel_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, wheel_main, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WHEEL_TICK_MS  1
+#define WHEEL_SLOTS    1024     // one turn = 1.024 s; longer timers ride extra turns
+
+/*
+ * Hashed timing wheel shared by the whole server: idle/keepalive checks,
+ * batching windows and paste deadlines. Arming and cancelling are
+ * O(1); one thread advances the wheel a tick at a time and only runs
+ * while something is armed.
+ *
+ * Callbacks run on the wheel thread without any wheel lock held, so they
+ * may re-arm their own timer, but must not block for long. Timers are
+ * embedded in the objects they serve and need no allocation.
+ */
+typedef struct wheel_timer wheel_timer_t;
+typedef void (*wheel_fn)(wheel_timer_t *t, void *arg);
+
+struct wheel_timer {
+    wheel_timer_t *next, *prev;     // slot list; NULL when not armed
+    uint64_t       expires;         // absolute tick
+    wheel_fn       fn;
+    void          *arg;
+};
+
+void wheel_timer_init(wheel_timer_t *t, wheel_fn fn, void *arg);
+
+/* Fire fn(t, arg) after delay_ms (rounded up to a tick); re-arming moves it */
+void wheel_arm(wheel_timer_t *t, uint64_t delay_ms);
+
+/*
+ * Disarm t. If its callback is running right now, wait for it to return,
+ * so the object holding t can be freed afterwards. Never call this from
+ * t's own callback.
+ */
+void wheel_cancel(wheel_timer_t *t);
+
+int  wheel_start(void);
+
+#endif